@@ -14,5 +14,8 @@ void _panic(const char*, int, const char*, ...) __attribute__((noreturn));
 #define assert(x) \
 	do { if (!(x)) panic("assertion failed: %s", #x); } while (0)
 
+// static_assert(x) will generate a compile-time error if 'x' is false.
+#define static_assert(x)	switch (x) case 0: case (x):
+
 
 #endif /* !JOS_INC_ASSERT_H */
@@ -0,0 +1,37 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_INC_E820_H
+#define JOS_INC_E820_H
+
+// The boot loader (boot/boot.S) asks the BIOS for its memory map
+// (INT 15h, AX = E820h) before leaving real mode, and leaves the
+// result at physical address E820_MAP for the kernel to pick up.
+
+#define E820_MAP	0x8000		// Physical address of struct E820Map
+#define E820_MAGIC	0x534D4150	// "SMAP", also the BIOS signature
+#define E820_MAX	32		// Maximum number of entries stored
+#define E820_ENTSZ	20		// sizeof(struct E820Entry)
+
+// Values of e_type
+#define E820_RAM	1		// Usable RAM
+#define E820_RESERVED	2		// Reserved, do not use
+
+#ifndef __ASSEMBLER__
+
+#include <inc/types.h>
+
+struct E820Entry {
+	uint64_t e_addr;		// Start of the range
+	uint64_t e_len;			// Length of the range in bytes
+	uint32_t e_type;		// E820_RAM, E820_RESERVED, ...
+} __attribute__((packed));
+
+struct E820Map {
+	uint32_t em_magic;		// E820_MAGIC if the map is valid
+	uint32_t em_count;		// Number of entries
+	struct E820Entry em_entries[E820_MAX];
+};
+
+#endif /* !__ASSEMBLER__ */
+
+#endif /* !JOS_INC_E820_H */
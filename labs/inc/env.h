@@ -43,6 +43,11 @@ struct Env {
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
 
+	// Scheduling (see kern/sched.c)
+	TAILQ_ENTRY(Env) env_runq_link;	// Run queue link pointers
+	uint32_t env_prio;		// Priority, 0 (highest) .. SCHED_NPRIO-1
+	uint32_t env_slice;		// Timer ticks left in its time slice
+
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 	physaddr_t env_cr3;		// Physical address of page dir
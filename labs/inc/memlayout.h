@@ -163,19 +163,58 @@ extern volatile pde_t vpd[];     // VA of current page directory
  * You can map a Page * to the corresponding physical address
  * with page2pa() in kern/pmap.h.
  */
-LIST_HEAD(Page_list, Page);
-typedef LIST_ENTRY(Page) Page_LIST_entry_t;
-
+// The structure is packed into 8 bytes, so that many of them share a
+// cache line and the read-only copy at UPAGES stays small.  For that
+// reason the free list links are page numbers instead of pointers, and
+// pp_next shares its word with pp_ref: a page on a free list has no
+// references.  So pp_ref is only a reference count while pp_flags has
+// none of PP_FREE, PP_CACHED and PP_ZERO; on a page on one of the
+// kernel's lists (buddy, color, zero pool, quicklist) it holds a link,
+// and anyone reading pages[] (e.g. at UPAGES) must check pp_flags
+// first.  Every other free page, and a page just taken off a list,
+// has a pp_ref of 0.
 struct Page {
-	Page_LIST_entry_t pp_link;	/* free list link */
-
-	// pp_ref is the count of pointers (usually in page table entries)
-	// to this page, for pages allocated using page_alloc.
-	// Pages allocated at boot time using pmap.c's
-	// boot_alloc do not have valid reference count fields.
+	union {
+		// Free list link: page number of the next page, or
+		// PAGE_NIL.  Use the page_list_* functions in kern/pmap.h.
+		uint32_t pp_next;
+
+		// pp_ref is the count of pointers (usually in page table
+		// entries) to this page, for pages allocated using
+		// page_alloc.  It is a full word so that page_ref_inc() and
+		// page_decref() can update it atomically, and so that a
+		// widely shared page cannot overflow it.
+		// Pages allocated at boot time using pmap.c's
+		// boot_alloc do not have valid reference count fields,
+		// and neither do pages on a list (see above).
+		volatile uint32_t pp_ref;
+	};
+
+	// Page number of the previous page on the free list, or PAGE_NIL.
+	uint32_t pp_prev : 20;
+
+	// Buddy allocator state, see kern/pmap.c.  pp_order is the log2
+	// size (in pages) of the free block this page heads, while
+	// PP_FREE is set in pp_flags.  On an allocated page, a pp_order
+	// of PAGE_LARGE_ORDER means the page is part of a block mapped as
+	// a 4MB user page, which page_insert() won't map on its own.
+	uint32_t pp_order : 4;
+	uint32_t pp_flags : 4;
+};
 
-	uint16_t pp_ref;
+// Head of a list of Pages linked through pp_next and pp_prev.
+struct Page_list {
+	uint32_t pl_first;	// Page number of the first page, or PAGE_NIL
 };
 
+// Null free list link
+#define PAGE_NIL	0xFFFFF
+
+// Values of pp_flags in struct Page
+#define PP_FREE		0x01	// Page heads a block on a buddy free list
+#define PP_CACHED	0x02	// Page sits in a page magazine or color list
+#define PP_ZERO		0x04	// Page sits in the pre-zeroed page pool
+#define PP_PGTABLE	0x08	// Page is in use as a page table
+
 #endif /* !__ASSEMBLER__ */
 #endif /* !JOS_INC_MEMLAYOUT_H */
@@ -66,18 +66,30 @@
 #define PTE_A		0x020	// Accessed
 #define PTE_D		0x040	// Dirty
 #define PTE_PS		0x080	// Page Size
+#define PTE_G		0x100	// Global
 #define PTE_MBZ		0x180	// Bits must be zero
 
-// The PTE_AVAIL bits aren't used by the kernel or interpreted by the
-// hardware, so user processes are allowed to set them arbitrarily.
+// The PTE_AVAIL bits aren't interpreted by the hardware.
 #define PTE_AVAIL	0xE00	// Available for software use
 
+// The kernel marks copy-on-write pages with one of the PTE_AVAIL bits.
+// User processes may set the others arbitrarily, but not this one.
+#define PTE_COW		0x800	// Copy-on-write
+#define PTE_USER_AVAIL	(PTE_AVAIL & ~PTE_COW)
+
 // Only flags in PTE_USER may be used in system calls.
-#define PTE_USER	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
+#define PTE_USER	(PTE_USER_AVAIL | PTE_P | PTE_W | PTE_U)
+
+// System calls that allocate or map memory also accept PTE_PS, to ask
+// for one 4MB page at a PTSIZE-aligned address instead of a 4KB page.
+#define PTE_SYSCALL	(PTE_USER | PTE_PS)
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)	((physaddr_t) (pte) & ~0xFFF)
 
+// Address in a page directory entry that maps a 4MB page (PTE_PS set)
+#define PDE_LARGE_ADDR(pde)	((physaddr_t) (pde) & ~(PTSIZE - 1))
+
 // Control Register flags
 #define CR0_PE		0x00000001	// Protection Enable
 #define CR0_MP		0x00000002	// Monitor coProcessor
@@ -92,6 +104,7 @@
 #define CR0_PG		0x80000000	// Paging
 
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
@@ -99,6 +112,16 @@
 #define CR4_PVI		0x00000002	// Protected-Mode Virtual Interrupts
 #define CR4_VME		0x00000001	// V86 Mode Extensions
 
+// CPUID feature flags (cpuid leaf 1, %edx)
+#define CPUID_PSE	0x00000008	// Page Size Extensions
+#define CPUID_SEP	0x00000800	// SYSENTER/SYSEXIT
+#define CPUID_PGE	0x00002000	// Page Global Enable
+
+// Model-specific registers
+#define MSR_IA32_SYSENTER_CS	0x174	// SYSENTER code segment
+#define MSR_IA32_SYSENTER_ESP	0x175	// SYSENTER stack pointer
+#define MSR_IA32_SYSENTER_EIP	0x176	// SYSENTER entry point
+
 // Eflags register
 #define FL_CF		0x00000001	// Carry Flag
 #define FL_PF		0x00000004	// Parity Flag
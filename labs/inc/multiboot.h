@@ -0,0 +1,51 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_INC_MULTIBOOT_H
+#define JOS_INC_MULTIBOOT_H
+
+// A Multiboot-compliant boot loader (e.g., GRUB) enters the kernel
+// with MULTIBOOT_BOOTLOADER_MAGIC in %eax and the physical address of
+// a struct MultibootInfo in %ebx.  kern/entry.S saves both.
+
+#define MULTIBOOT_BOOTLOADER_MAGIC	0x2BADB002
+
+// Bits in mbi_flags: which of the fields below are valid
+#define MULTIBOOT_INFO_MEMORY	0x001	// mbi_mem_lower, mbi_mem_upper
+#define MULTIBOOT_INFO_CMDLINE	0x004	// mbi_cmdline
+#define MULTIBOOT_INFO_MMAP	0x040	// mbi_mmap_length, mbi_mmap_addr
+
+// Values of mm_type
+#define MULTIBOOT_MEMORY_AVAILABLE	1
+
+#ifndef __ASSEMBLER__
+
+#include <inc/types.h>
+
+struct MultibootInfo {
+	uint32_t mbi_flags;
+	uint32_t mbi_mem_lower;		// KB of memory below 1MB
+	uint32_t mbi_mem_upper;		// KB of memory above 1MB
+	uint32_t mbi_boot_device;
+	uint32_t mbi_cmdline;		// Physical address of command line
+	uint32_t mbi_mods_count;
+	uint32_t mbi_mods_addr;
+	uint32_t mbi_syms[4];
+	uint32_t mbi_mmap_length;	// Size of the memory map in bytes
+	uint32_t mbi_mmap_addr;		// Physical address of the memory map
+};
+
+// Memory map entry.  mm_size is the size of the rest of the entry,
+// not counting mm_size itself.
+struct MultibootMmap {
+	uint32_t mm_size;
+	uint64_t mm_addr;
+	uint64_t mm_len;
+	uint32_t mm_type;
+} __attribute__((packed));
+
+extern uint32_t multiboot_magic;
+extern physaddr_t multiboot_info;
+
+#endif /* !__ASSEMBLER__ */
+
+#endif /* !JOS_INC_MULTIBOOT_H */
@@ -216,4 +216,94 @@ struct {								\
 	*(elm)->field.le_prev = LIST_NEXT((elm), field);		\
 } while (0)
 
+/*
+ * Tail queue declarations.
+ */
+
+/*
+ * A tail queue is headed by a structure defined by the TAILQ_HEAD macro.  This
+ * structure contains a pointer to the first element on the queue and a pointer
+ * to the link field of the last one, so that new elements can be added at the
+ * tail, as well as at the head, in constant time.  Like lists, the elements are
+ * doubly linked so that an arbitrary element can be removed without traversing
+ * the queue.  A TAILQ_HEAD structure is declared as follows:
+ *
+ *       TAILQ_HEAD(HEADNAME, TYPE) head;
+ *
+ * An empty tail queue must be set up with TAILQ_INIT before use.
+ */
+#define	TAILQ_HEAD(name, type)						\
+struct name {								\
+	struct type *tqh_first;	/* first element */			\
+	struct type **tqh_last;	/* addr of last next element */		\
+}
+
+/*
+ * Use this inside a structure "TAILQ_ENTRY(type) field" to use
+ * x as the tail queue piece.  tqe_prev works like le_prev above.
+ */
+#define	TAILQ_ENTRY(type)						\
+struct {								\
+	struct type *tqe_next;	/* next element */			\
+	struct type **tqe_prev;	/* ptr to ptr to this element */	\
+}
+
+/*
+ * Tail queue functions.
+ */
+
+#define	TAILQ_EMPTY(head)	((head)->tqh_first == NULL)
+
+#define	TAILQ_FIRST(head)	((head)->tqh_first)
+
+#define	TAILQ_NEXT(elm, field)	((elm)->field.tqe_next)
+
+#define	TAILQ_FOREACH(var, head, field)					\
+	for ((var) = TAILQ_FIRST((head));				\
+	    (var);							\
+	    (var) = TAILQ_NEXT((var), field))
+
+/*
+ * Reset the tail queue named "head" to the empty queue.
+ */
+#define	TAILQ_INIT(head) do {						\
+	TAILQ_FIRST((head)) = NULL;					\
+	(head)->tqh_last = &TAILQ_FIRST((head));			\
+} while (0)
+
+/*
+ * Insert the element "elm" at the head of the tail queue named "head".
+ */
+#define	TAILQ_INSERT_HEAD(head, elm, field) do {			\
+	if ((TAILQ_NEXT((elm), field) = TAILQ_FIRST((head))) != NULL)	\
+		TAILQ_FIRST((head))->field.tqe_prev =			\
+		    &TAILQ_NEXT((elm), field);				\
+	else								\
+		(head)->tqh_last = &TAILQ_NEXT((elm), field);		\
+	TAILQ_FIRST((head)) = (elm);					\
+	(elm)->field.tqe_prev = &TAILQ_FIRST((head));			\
+} while (0)
+
+/*
+ * Insert the element "elm" at the tail of the tail queue named "head".
+ */
+#define	TAILQ_INSERT_TAIL(head, elm, field) do {			\
+	TAILQ_NEXT((elm), field) = NULL;				\
+	(elm)->field.tqe_prev = (head)->tqh_last;			\
+	*(head)->tqh_last = (elm);					\
+	(head)->tqh_last = &TAILQ_NEXT((elm), field);			\
+} while (0)
+
+/*
+ * Remove the element "elm" from the tail queue named "head".
+ */
+#define	TAILQ_REMOVE(head, elm, field) do {				\
+	if (TAILQ_NEXT((elm), field) != NULL)				\
+		TAILQ_NEXT((elm), field)->field.tqe_prev =		\
+		    (elm)->field.tqe_prev;				\
+	else								\
+		(head)->tqh_last = (elm)->field.tqe_prev;		\
+	*(elm)->field.tqe_prev = TAILQ_NEXT((elm), field);		\
+} while (0)
+
 #endif	/* !_SYS_QUEUE_H_ */
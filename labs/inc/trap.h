@@ -29,6 +29,17 @@
 #define T_SYSCALL   48		// system call
 #define T_DEFAULT   500		// catchall
 
+// System calls can also enter through SYSENTER, if the CPU has it
+// (CPUID_SEP), without building a Trapframe.  Arguments go in
+// registers only: %eax holds the system call number, %edx, %ecx, %ebx
+// and %edi the first four arguments, %esi the address to return to and
+// %ebp the user stack pointer.  The result comes back in %eax; %ecx and
+// %edx are clobbered, and EFLAGS comes back with only IF set.  Calls
+// that need a fifth argument, or that save or switch the caller's
+// Trapframe (e.g. sys_yield), must use int T_SYSCALL; the kernel fails
+// the latter with -E_INVAL.  (Until kern/syscall.c exists, the kernel
+// fails them all: see sysenter_syscall().)
+
 // Hardware IRQ numbers. We receive these as (IRQ_OFFSET+IRQ_WHATEVER)
 #define IRQ_TIMER        0
 #define IRQ_KBD          1
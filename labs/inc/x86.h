@@ -34,6 +34,11 @@ static __inline uint32_t read_ebp(void) __attribute__((always_inline));
 static __inline uint32_t read_esp(void) __attribute__((always_inline));
 static __inline void cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp);
 static __inline uint64_t read_tsc(void) __attribute__((always_inline));
+static __inline uint32_t xadd(volatile uint32_t *addr, uint32_t val) __attribute__((always_inline));
+static __inline uint32_t xchg(volatile uint32_t *addr, uint32_t newval) __attribute__((always_inline));
+static __inline uint32_t bsf(uint32_t val) __attribute__((always_inline));
+static __inline uint64_t rdmsr(uint32_t msr) __attribute__((always_inline));
+static __inline void wrmsr(uint32_t msr, uint64_t val) __attribute__((always_inline));
 
 static __inline void
 breakpoint(void)
@@ -274,4 +279,50 @@ read_tsc(void)
         return tsc;
 }
 
+// Atomically add 'val' to *addr, returning the old value of *addr.
+static __inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t val)
+{
+	__asm __volatile("lock; xaddl %0,%1"
+			 : "+r" (val), "+m" (*addr)
+			 :
+			 : "memory", "cc");
+	return val;
+}
+
+// Atomically store 'newval' in *addr, returning the old value of *addr.
+static __inline uint32_t
+xchg(volatile uint32_t *addr, uint32_t newval)
+{
+	// xchg with a memory operand is always locked.
+	__asm __volatile("xchgl %0,%1"
+			 : "+r" (newval), "+m" (*addr)
+			 :
+			 : "memory", "cc");
+	return newval;
+}
+
+static __inline uint32_t
+bsf(uint32_t val)
+{
+	// Index of the lowest set bit; undefined if val is 0.
+	uint32_t idx;
+	__asm __volatile("bsfl %1,%0" : "=r" (idx) : "rm" (val) : "cc");
+	return idx;
+}
+
+static __inline uint64_t
+rdmsr(uint32_t msr)
+{
+	uint64_t val;
+	__asm __volatile("rdmsr" : "=A" (val) : "c" (msr));
+	return val;
+}
+
+static __inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	__asm __volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
 #endif /* !JOS_INC_X86_H */
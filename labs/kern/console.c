@@ -7,6 +7,7 @@
 #include <inc/assert.h>
 
 #include <kern/console.h>
+#include <kern/pmap.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
@@ -459,8 +460,9 @@ getchar(void)
 {
 	int c;
 
+	/* use the idle time to pre-zero free pages */
 	while ((c = cons_getc()) == 0)
-		/* do nothing */;
+		page_zero_idle();
 	return c;
 }
 
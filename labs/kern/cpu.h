@@ -0,0 +1,22 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_CPU_H
+#define JOS_KERN_CPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Maximum number of CPUs
+#define NCPU		8
+
+// The index of the CPU we are running on, in [0, NCPU).
+// Only the bootstrap processor runs for now.
+static inline int
+cpunum(void)
+{
+	return 0;
+}
+
+#endif	// !JOS_KERN_CPU_H
@@ -8,6 +8,10 @@
 #include <kern/console.h>
 #include <kern/pmap.h>
 #include <kern/kclock.h>
+#include <kern/slab.h>
+#include <kern/selftest.h>
+#include <kern/sched.h>
+#include <kern/trap.h>
 
 
 void
@@ -24,9 +28,17 @@ i386_init(void)
 	// Can't call cprintf until after we do this!
 	cons_init();
 
+	// Pick the self-test depth while the boot command line is
+	// still reachable through the low-memory mapping.
+	selftest_init();
+
 	// Lab 2 memory management initialization functions
 	i386_detect_memory();
 	i386_vm_init();
+	sysenter_init();
+	kmem_init();
+	sched_init();
+	selftest_print_summary();
 
 	// Drop into the kernel monitor.
 	while (1)
@@ -10,6 +10,10 @@
 #include <kern/console.h>
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
+#include <kern/pmap.h>
+#include <kern/slab.h>
+#include <kern/selftest.h>
+#include <kern/sched.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -24,6 +28,13 @@ struct Command {
 static struct Command commands[] = {
 	{ "help", "Display this list of commands", mon_help },
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
+	{ "pagemag", "Display page magazine, zero pool and page table cache stats", mon_pagemag },
+	{ "memstat", "Display page allocator and page table counters ('memstat reset' zeroes them, 'memstat bench' times 4KB KERNBASE mappings)", mon_memstat },
+	{ "pagecolor", "Show or set page coloring, or benchmark it ('pagecolor [on|off|bench [npages [rounds]]]')", mon_pagecolor },
+	{ "physmap", "Display a run-length map of physical memory ('physmap [maxruns]')", mon_physmap },
+	{ "slabinfo", "Display kernel object cache usage", mon_slabinfo },
+	{ "selftest", "Display boot self-test timings", mon_selftest },
+	{ "sched", "Display scheduler run queue depths", mon_sched },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -56,6 +67,103 @@ mon_kerninfo(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_pagemag(int argc, char **argv, struct Trapframe *tf)
+{
+	page_mag_print_stats();
+	page_zero_print_stats();
+	pgtable_print_stats();
+	return 0;
+}
+
+int
+mon_memstat(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc == 2 && strcmp(argv[1], "bench") == 0) {
+		boot_map_bench();
+		return 0;
+	}
+	if (argc > 2 || (argc == 2 && strcmp(argv[1], "reset") != 0)) {
+		cprintf("Usage: memstat [reset|bench]\n");
+		return 0;
+	}
+	pmap_print_stats();
+	if (argc == 2) {
+		pmap_reset_stats();
+		cprintf("Counters reset.\n");
+	}
+	return 0;
+}
+
+int
+mon_pagecolor(int argc, char **argv, struct Trapframe *tf)
+{
+	long npages = 64, rounds = 100;
+	char *end = "";
+
+	if (argc == 1)
+		;
+	else if (argc == 2 && strcmp(argv[1], "on") == 0)
+		page_color_set(1);
+	else if (argc == 2 && strcmp(argv[1], "off") == 0)
+		page_color_set(0);
+	else if (argc <= 4 && strcmp(argv[1], "bench") == 0) {
+		if (argc > 2)
+			npages = strtol(argv[2], &end, 0);
+		if (argc > 3 && *end == 0)
+			rounds = strtol(argv[3], &end, 0);
+		if (*end != 0 || npages <= 0 || rounds <= 0) {
+			cprintf("Usage: pagecolor bench [npages [rounds]]\n");
+			return 0;
+		}
+		page_color_bench(npages, rounds);
+		return 0;
+	} else {
+		cprintf("Usage: pagecolor [on|off|bench [npages [rounds]]]\n");
+		return 0;
+	}
+	page_color_print_stats();
+	return 0;
+}
+
+int
+mon_physmap(int argc, char **argv, struct Trapframe *tf)
+{
+	long maxruns = PAGE_MAP_MAXRUNS;
+	char *end;
+
+	if (argc > 1) {
+		maxruns = strtol(argv[1], &end, 0);
+		if (argc > 2 || *end != 0 || maxruns < 0) {
+			cprintf("Usage: physmap [maxruns]\n");
+			return 0;
+		}
+	}
+	page_print_map(maxruns);
+	return 0;
+}
+
+int
+mon_slabinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	kmem_print_stats();
+	return 0;
+}
+
+int
+mon_selftest(int argc, char **argv, struct Trapframe *tf)
+{
+	selftest_print_summary();
+	return 0;
+}
+
+int
+mon_sched(int argc, char **argv, struct Trapframe *tf)
+{
+	sched_print_stats();
+	return 0;
+}
+
 int
 mon_backtrace(int argc, char **argv, struct Trapframe *tf)
 {
@@ -14,6 +14,13 @@ void monitor(struct Trapframe *tf);
 // Functions implementing monitor commands.
 int mon_help(int argc, char **argv, struct Trapframe *tf);
 int mon_kerninfo(int argc, char **argv, struct Trapframe *tf);
+int mon_pagemag(int argc, char **argv, struct Trapframe *tf);
+int mon_memstat(int argc, char **argv, struct Trapframe *tf);
+int mon_pagecolor(int argc, char **argv, struct Trapframe *tf);
+int mon_physmap(int argc, char **argv, struct Trapframe *tf);
+int mon_slabinfo(int argc, char **argv, struct Trapframe *tf);
+int mon_selftest(int argc, char **argv, struct Trapframe *tf);
+int mon_sched(int argc, char **argv, struct Trapframe *tf);
 int mon_backtrace(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
@@ -5,9 +5,14 @@
 #include <inc/error.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/e820.h>
+#include <inc/multiboot.h>
 
 #include <kern/pmap.h>
 #include <kern/kclock.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/selftest.h>
 
 // These variables are set by i386_detect_memory()
 static physaddr_t maxpa;	// Maximum physical address
@@ -15,13 +20,169 @@ size_t npage;			// Amount of physical memory (in pages)
 static size_t basemem;		// Amount of base memory (in bytes)
 static size_t extmem;		// Amount of extended memory (in bytes)
 
+// Usable physical memory, as [mr_start, mr_end) ranges of whole pages,
+// sorted and non-overlapping.  Only the first 2^32 - KERNBASE bytes of
+// physical memory can be used, since that is all that is mapped at
+// KERNBASE.
+#define NMEMRANGE	E820_MAX
+#define MAXPHYSMEM	((physaddr_t) -KERNBASE)
+struct MemRange {
+	physaddr_t mr_start;
+	physaddr_t mr_end;
+};
+static struct MemRange mem_ranges[NMEMRANGE];
+static int nmem_ranges;
+
 // These variables are set in i386_vm_init()
 pde_t* boot_pgdir;		// Virtual address of boot time page directory
 physaddr_t boot_cr3;		// Physical address of boot time page directory
 static char* boot_freemem;	// Pointer to next byte of free mem
+static int pse_enabled;		// Map with 4MB pages where possible?
+static uint32_t pte_global;	// PTE_G if the CPU supports it, else 0
+static uint32_t boot_nlarge;	// 4MB pages used by boot_map_segment
+static uint32_t boot_map_cycles;	// Cycles spent mapping KERNBASE
+
+// The page directory each CPU has loaded with pgdir_load(), or NULL
+// before paging is on.  pgdir_walk() reaches the page tables of this
+// page directory through the VPT self-mapping.
+static pde_t *cur_pgdirs[NCPU];
 
 struct Page* pages;		// Virtual address of physical page array
-static struct Page_list page_free_list;	// Free list of physical pages
+
+// Locking.  Two kinds of lock protect the structures in this file:
+//
+//   page_lock	 The buddy free lists, the pre-zeroed pool and the page
+//		 table quicklist, with their counters and the PP_FREE
+//		 and PP_ZERO page flags.  The per-CPU page magazines need
+//		 no lock: each CPU only touches its own.
+//   pgdir_locks The page tables of an address space, and the pp_ref
+//		 counts its mappings hold.  Each page directory hashes
+//		 to one lock in the table (see pgdir_lock()), so
+//		 different address spaces rarely contend.
+//
+// Lock ordering: a page directory lock may be held while taking
+// page_lock (pgdir_walk() allocates page tables, page_remove() frees
+// pages), never the other way around.  pgdir_copy_cow() needs two page
+// directory locks, and takes the one at the lower address first.
+// Functions named *_locked expect the caller to hold the lock of the
+// page directory they are given.
+//
+// There is no cross-CPU TLB shootdown.  tlb_invalidate() and the TLB
+// gather only flush the current CPU's TLB, when it has 'pgdir' loaded
+// or the address is in the kernel half that every page directory
+// shares; nothing tells other CPUs running the same page directory.  That is
+// only correct because just the bootstrap processor runs (see
+// kern/cpu.h).  Before other CPUs are started, every invalidation has
+// to reach each CPU whose cur_pgdirs[] entry matches, and complete,
+// before page_remove() and the TLB gather free the unmapped pages.
+static struct Spinlock page_lock = SPINLOCK_INIT("page_lock");
+static struct Spinlock pgdir_locks[PGDIR_NLOCK];
+
+// Buddy free lists of physical pages: page_free_area[k] holds the free
+// blocks of 2^k pages.  page_free_area[0] is the plain free page list
+// that page_alloc() takes from first.
+static struct Page_list page_free_area[PAGE_NORDER];
+
+// Per-CPU caches of free single pages in front of the buddy lists.
+// page_alloc() and page_free() only touch the current CPU's magazine,
+// and go to the buddy lists PAGE_MAG_BATCH pages at a time.  Pages in
+// a magazine are marked PP_CACHED and are never coalesced.  Each
+// magazine starts on its own cache line.
+struct PageMagazine {
+	struct Page *pm_pages[PAGE_MAG_SIZE];	// LIFO: top is cache-hot
+	int pm_count;				// Number of pages cached
+	uint32_t pm_hits;			// page_alloc()s served from cache
+	uint32_t pm_misses;			// page_alloc()s that had to refill
+	uint32_t pm_refills;			// Batches taken from buddy lists
+	uint32_t pm_drains;			// Batches given back
+	uint32_t pm_color;			// Next color page_alloc() hands out
+} __attribute__((aligned(CACHE_LINE)));
+
+static struct PageMagazine page_mags[NCPU];
+
+// Page coloring.  While page_color_mode is set, page_alloc() hands out
+// pages of rotating colors (physical page number modulo PAGE_NCOLOR),
+// so pages allocated one after the other for a buffer spread evenly
+// over a physically indexed cache.  The free pages of each color wait
+// on page_color_lists[], filled a PAGE_NCOLOR-page buddy block at a
+// time (such a block holds one page of each color).  Pages on a color
+// list are marked PP_CACHED and are protected by page_lock.
+//
+// page_color_mode is only changed under page_lock, by page_color_set().
+// The page magazines know nothing of colors, so each CPU empties its
+// own the next time it allocates with coloring on.
+// page_alloc_batch() takes no colors: the pages of one buddy block come
+// out physically consecutive, so their colors already rotate.  Nor does
+// the page table quicklist: the hardware walks one entry per page
+// table at a time, so a page table's color hardly matters.
+int page_color_mode;
+static struct Page_list page_color_lists[PAGE_NCOLOR];
+static size_t page_color_count[PAGE_NCOLOR];	// Pages on each list
+static size_t page_ncolored;			// Pages on all lists
+static uint32_t page_color_hits;	// Pages of the color asked for
+static uint32_t page_color_misses;	// Pages of some other color
+
+// Free pages that have already been cleared, for page_alloc_zeroed().
+// Filled one page at a time by page_zero_idle() when the CPU has
+// nothing better to do.  Pages in the pool are marked PP_ZERO.
+static struct Page_list page_zero_list;
+static size_t page_nzero;		// Pages in page_zero_list
+static int page_zero_ready;		// Set once i386_vm_init() is done
+static uint32_t page_zero_hits;		// page_alloc_zeroed()s from the pool
+static uint32_t page_zero_misses;	// page_alloc_zeroed()s that memset
+
+// Cleared pages set aside for page tables (the "quicklist").  Emptied
+// page tables come back here through pgtable_free(), so recycling a
+// page table never clears it again.  Pages on the list are marked
+// PP_ZERO, like those in the zero pool.
+static struct Page_list pgtable_quick;
+static size_t pgtable_nquick;		// Pages in pgtable_quick
+static uint32_t pgtable_allocs;		// Page tables handed out
+static uint32_t pgtable_frees;		// Page tables returned
+static uint32_t pgtable_refills;	// Refills from the page allocator
+static uint32_t pgtable_trims;		// Trims back to the page allocator
+
+// A page of zeros shared read-only by every demand-zero mapping.
+// Mapping it takes no reference: page_ref_inc() and page_decref()
+// leave its count alone, so it is never freed.
+struct Page *zero_page;
+
+// Per-CPU counts of memory-management calls, shown and reset by the
+// `memstat` monitor command.  Each CPU only bumps its own slot, so a
+// count costs one increment and needs no lock; slots are a cache line
+// apart, so the increments don't contend either.
+struct PmapStats {
+	uint32_t ps_page_alloc;		// Pages handed out by page_alloc*()
+	uint32_t ps_page_alloc_fail;	// page_alloc*() calls that failed
+	uint32_t ps_page_free;		// Pages freed, by any page_free*()
+	uint32_t ps_pgdir_walk;		// pgdir_walk() calls
+	uint32_t ps_pgtable_new;	// Page tables pgdir_walk() created
+	uint32_t ps_page_insert;	// page_insert() calls
+	uint32_t ps_page_remove;	// page_remove() calls
+	uint32_t ps_tlb_invalidate;	// Single-page TLB invalidations
+	uint32_t ps_tlb_flush;		// Full TLB flushes
+} __attribute__((aligned(CACHE_LINE)));
+
+static struct PmapStats pmap_stats[NCPU];
+
+#define PMAP_STAT(field)	(pmap_stats[cpunum()].field++)
+#define PMAP_STAT_ADD(field, n)	(pmap_stats[cpunum()].field += (n))
+
+//
+// Count the outcome of a page_alloc*() call that hands 'n' pages to
+// its caller, or fails with 'r'.  Only the exported allocators count,
+// and only through here: pages the allocator moves into its own pools
+// (the zero pool, the page table quicklist) are not allocations.
+//
+static int
+pmap_stat_alloc(int r, size_t n)
+{
+	if (r < 0)
+		PMAP_STAT(ps_page_alloc_fail);
+	else
+		PMAP_STAT_ADD(ps_page_alloc, n);
+	return r;
+}
 
 // Global descriptor table.
 //
@@ -60,24 +221,129 @@ nvram_read(int r)
 	return mc146818_read(r) | (mc146818_read(r + 1) << 8);
 }
 
+//
+// Record [start, start+len) as usable memory in mem_ranges[],
+// trimmed to whole pages below MAXPHYSMEM and merged with any
+// range it overlaps or touches.
+//
+static void
+mem_range_add(uint64_t start, uint64_t len)
+{
+	physaddr_t s, e;
+	int i, j;
+
+	if (start >= MAXPHYSMEM || len == 0)
+		return;
+	s = ROUNDUP((physaddr_t) start, PGSIZE);
+	e = ROUNDDOWN((physaddr_t) MIN(start + len, (uint64_t) MAXPHYSMEM), PGSIZE);
+	if (s >= e)
+		return;
+
+	// Find the first range that ends at or after s.
+	for (i = 0; i < nmem_ranges && mem_ranges[i].mr_end < s; i++)
+		/* do nothing */;
+	// Absorb every range that overlaps or touches [s, e).
+	for (j = i; j < nmem_ranges && mem_ranges[j].mr_start <= e; j++) {
+		s = MIN(s, mem_ranges[j].mr_start);
+		e = MAX(e, mem_ranges[j].mr_end);
+	}
+	if (j == i && nmem_ranges == NMEMRANGE) {
+		warn("mem_range_add: too many ranges, ignoring [%08x, %08x)", s, e);
+		return;
+	}
+	// Replace ranges [i, j) with the merged range.
+	memmove(&mem_ranges[i + 1], &mem_ranges[j],
+		(nmem_ranges - j) * sizeof(mem_ranges[0]));
+	nmem_ranges += 1 - (j - i);
+	mem_ranges[i].mr_start = s;
+	mem_ranges[i].mr_end = e;
+}
+
+//
+// Read the memory map a Multiboot loader (e.g., GRUB) left for us.
+// Returns the number of usable ranges found.
+//
+static int
+detect_multiboot(void)
+{
+	struct MultibootInfo *mbi;
+	struct MultibootMmap *mm;
+	physaddr_t p, end;
+
+	if (multiboot_magic != MULTIBOOT_BOOTLOADER_MAGIC
+	    || multiboot_info >= MAXPHYSMEM)
+		return 0;
+	// Paging is not on yet, so use the KERNBASE segment mapping.
+	mbi = (struct MultibootInfo *) (KERNBASE + multiboot_info);
+	if (mbi->mbi_flags & MULTIBOOT_INFO_MMAP) {
+		p = mbi->mbi_mmap_addr;
+		end = p + mbi->mbi_mmap_length;
+		for (; p < end && end <= MAXPHYSMEM; p += mm->mm_size + 4) {
+			mm = (struct MultibootMmap *) (KERNBASE + p);
+			if (mm->mm_type == MULTIBOOT_MEMORY_AVAILABLE)
+				mem_range_add(mm->mm_addr, mm->mm_len);
+		}
+	} else if (mbi->mbi_flags & MULTIBOOT_INFO_MEMORY) {
+		mem_range_add(0, mbi->mbi_mem_lower * 1024);
+		mem_range_add(EXTPHYSMEM, mbi->mbi_mem_upper * 1024);
+	}
+	return nmem_ranges;
+}
+
+//
+// Read the BIOS E820 memory map that boot/boot.S left for us.
+// Returns the number of usable ranges found.
+//
+static int
+detect_e820(void)
+{
+	struct E820Map *map;
+	uint32_t i;
+
+	map = (struct E820Map *) (KERNBASE + E820_MAP);
+	if (map->em_magic != E820_MAGIC || map->em_count > E820_MAX)
+		return 0;
+	for (i = 0; i < map->em_count; i++)
+		if (map->em_entries[i].e_type == E820_RAM)
+			mem_range_add(map->em_entries[i].e_addr,
+				      map->em_entries[i].e_len);
+	return nmem_ranges;
+}
+
 void
 i386_detect_memory(void)
 {
+	const char *source;
+	int i;
+
 	// CMOS tells us how many kilobytes there are
 	basemem = ROUNDDOWN(nvram_read(NVRAM_BASELO)*1024, PGSIZE);
 	extmem = ROUNDDOWN(nvram_read(NVRAM_EXTLO)*1024, PGSIZE);
 
-	// Calculate the maximum physical address based on whether
-	// or not there is any extended memory.  See comment in <inc/mmu.h>.
-	if (extmem)
-		maxpa = EXTPHYSMEM + extmem;
-	else
-		maxpa = basemem;
+	// Prefer a real memory map, which sees past the CMOS's 64MB
+	// limit and knows about holes.
+	if (detect_multiboot())
+		source = "multiboot";
+	else if (detect_e820())
+		source = "e820";
+	else {
+		source = "cmos";
+		mem_range_add(0, basemem);
+		mem_range_add(EXTPHYSMEM, extmem);
+	}
+	if (nmem_ranges == 0)
+		panic("i386_detect_memory: no usable memory");
 
+	// The maximum physical address is the end of the last range.
+	maxpa = mem_ranges[nmem_ranges - 1].mr_end;
 	npage = maxpa / PGSIZE;
 
 	cprintf("Physical memory: %dK available, ", (int)(maxpa/1024));
 	cprintf("base = %dK, extended = %dK\n", (int)(basemem/1024), (int)(extmem/1024));
+	cprintf("Memory map (%s):\n", source);
+	for (i = 0; i < nmem_ranges; i++)
+		cprintf("  [%08x, %08x) usable\n",
+			mem_ranges[i].mr_start, mem_ranges[i].mr_end);
 }
 
 // --------------------------------------------------------------
@@ -85,9 +351,44 @@ i386_detect_memory(void)
 // --------------------------------------------------------------
 
 static void check_boot_pgdir(void);
-static void check_page_alloc();
+static void check_boot_pgdir_all(void);
+static void page_poison_free(void);
+static void check_page_alloc(void);
 static void page_check(void);
+static void check_cow(void);
+static void check_pgdir_create(void);
+static void check_page_color(void);
+static void check_vpt_walk(void);
+static void check_page_large(void);
 static void boot_map_segment(pde_t *pgdir, uintptr_t la, size_t size, physaddr_t pa, int perm);
+static void boot_map_pages(pde_t *pgdir, uintptr_t la, size_t n, physaddr_t pa, int perm);
+static void page_free_range(size_t start, size_t end);
+static void page_free_steal(struct Page_list *fl);
+static int page_alloc_nostat(struct Page **pp_store);
+static int page_alloc_batch_nostat(struct Page **out, size_t n);
+static int page_color_take(int color, struct Page **pp_store);
+static int page_buddy_alloc(int order, struct Page **pp_store);
+static size_t page_buddy_alloc_batch(struct Page **out, size_t n);
+static void page_buddy_free_batch(struct Page **pps, size_t n);
+static void page_mag_refill(struct PageMagazine *mag);
+static void page_mag_flush(struct PageMagazine *mag, int n);
+static void page_buddy_free(struct Page *pp, int order);
+static void page_color_drain(void);
+static void page_free_color(struct Page *pp);
+static int page_zero_take(struct Page **pp_store);
+static void page_zero_drain(void);
+static int pgtable_alloc(struct Page **pp_store);
+static void pgtable_quick_drain(void);
+static void page_free_return(struct Page_list *fl);
+static int page_insert_locked(pde_t *pgdir, struct Page *pp, void *va, int perm);
+static int page_insert_large_locked(pde_t *pgdir, struct Page *pp, void *va, int perm);
+static void page_decref_large(struct Page *pp);
+static void page_large_mark(struct Page *pp, int order);
+static struct Page *page_lookup_locked(pde_t *pgdir, void *va, pte_t **pte_store);
+static void page_remove_locked(pde_t *pgdir, void *va);
+static void pgdir_clear_pde_locked(pde_t *pgdir, void *va);
+static int page_fault_cow_large(pde_t *pgdir, void *va, int perm);
+static pte_t *pgdir_walk_current(const void *va, int create);
 
 //
 // A simple physical memory allocator, used only a few times
@@ -116,13 +417,14 @@ boot_alloc(uint32_t n, uint32_t align)
 	if (boot_freemem == 0)
 		boot_freemem = end;
 
-	// LAB 2: Your code here:
-	//	Step 1: round boot_freemem up to be aligned properly
-	//	Step 2: save current value of boot_freemem as allocated chunk
-	//	Step 3: increase boot_freemem to record allocation
-	//	Step 4: return allocated chunk
-
-	return NULL;
+	// Round boot_freemem up to be aligned properly,
+	// then record the allocation.
+	boot_freemem = ROUNDUP(boot_freemem, align);
+	v = boot_freemem;
+	boot_freemem += n;
+	if (PADDR(boot_freemem) > maxpa)
+		panic("boot_alloc: out of memory");
+	return v;
 }
 
 // Set up a two-level page table:
@@ -141,11 +443,17 @@ void
 i386_vm_init(void)
 {
 	pde_t* pgdir;
-	uint32_t cr0;
+	uint32_t cr0, edx;
+	uint64_t tsc;
 	size_t n;
 
-	// Delete this line:
-	panic("i386_vm_init: This function is not finished\n");
+	// Use 4MB pages for the big kernel mappings if the CPU has them.
+	cpuid(1, NULL, NULL, NULL, &edx);
+	pse_enabled = (edx & CPUID_PSE) != 0;
+
+	// Mark the kernel's mappings global if the CPU supports it, so
+	// they stay in the TLB across CR3 reloads.
+	pte_global = (edx & CPUID_PGE) ? PTE_G : 0;
 
 	//////////////////////////////////////////////////////////////////////
 	// create initial page directory.
@@ -173,8 +481,9 @@ i386_vm_init(void)
 	// 'npage' equals the number of physical pages in memory.  User-level
 	// programs will get read-only access to the array as well.
 	// You must allocate the array yourself.
-	// Your code goes here: 
-
+	n = npage * sizeof(struct Page);
+	pages = boot_alloc(n, PGSIZE);
+	memset(pages, 0, n);
 
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
@@ -183,9 +492,17 @@ i386_vm_init(void)
 	// particular, we can now map memory using boot_map_segment or page_insert
 	page_init();
 
-        check_page_alloc();
+	selftest_run("page_poison_free", page_poison_free, SELFTEST_FULL);
+	selftest_run("check_page_alloc", check_page_alloc, SELFTEST_QUICK);
 
-	page_check();
+	selftest_run("page_check", page_check, SELFTEST_QUICK);
+
+	selftest_run("check_page_color", check_page_color, SELFTEST_QUICK);
+
+	assert(page_alloc_zeroed(&zero_page) == 0);
+	zero_page->pp_ref = 1;
+
+	selftest_run("check_cow", check_cow, SELFTEST_QUICK);
 
 	//////////////////////////////////////////////////////////////////////
 	// Now we set up virtual memory 
@@ -196,7 +513,8 @@ i386_vm_init(void)
 	//    - the new image at UPAGES -- kernel R, user R
 	//      (ie. perm = PTE_U | PTE_P)
 	//    - pages itself -- kernel RW, user NONE
-	// Your code goes here:
+	boot_map_segment(pgdir, UPAGES, ROUNDUP(n, PGSIZE), PADDR(pages),
+			 PTE_U | pte_global);
 
 	//////////////////////////////////////////////////////////////////////
         // Use the physical memory that bootstack refers to as
@@ -206,7 +524,8 @@ i386_vm_init(void)
 	//     * [KSTACKTOP-KSTKSIZE, KSTACKTOP) -- backed by physical memory
 	//     * [KSTACKTOP-PTSIZE, KSTACKTOP-KSTKSIZE) -- not backed => faults
 	//     Permissions: kernel RW, user NONE
-	// Your code goes here:
+	boot_map_segment(pgdir, KSTACKTOP - KSTKSIZE, KSTKSIZE,
+			 PADDR(bootstack), PTE_W | pte_global);
 
 	//////////////////////////////////////////////////////////////////////
 	// Map all of physical memory at KERNBASE. 
@@ -215,10 +534,19 @@ i386_vm_init(void)
 	// We might not have 2^32 - KERNBASE bytes of physical memory, but
 	// we just set up the mapping anyway.
 	// Permissions: kernel RW, user NONE
-	// Your code goes here: 
+	// (`memstat` shows how long this took.)
+	tsc = read_tsc();
+	boot_map_segment(pgdir, KERNBASE, -KERNBASE, 0, PTE_W | pte_global);
+	boot_map_cycles = read_tsc() - tsc;
 
 	// Check that the initial page directory has been set up correctly.
-	check_boot_pgdir();
+	selftest_run("check_boot_pgdir", check_boot_pgdir, SELFTEST_QUICK);
+	selftest_run("check_boot_pgdir_all", check_boot_pgdir_all, SELFTEST_FULL);
+
+	// boot_pgdir's kernel half is now the template for new page
+	// directories.
+	selftest_run("check_pgdir_create", check_pgdir_create, SELFTEST_QUICK);
+	selftest_run("check_page_large", check_page_large, SELFTEST_QUICK);
 
 	//////////////////////////////////////////////////////////////////////
 	// On x86, segmentation maps a VA to a LA (linear addr) and
@@ -236,8 +564,12 @@ i386_vm_init(void)
 
 	// Map VA 0:4MB same as VA KERNBASE, i.e. to PA 0:4MB.
 	// (Limits our kernel to <4MB)
+	// If that is a 4MB page, PSE must be on before paging is.
 	pgdir[0] = pgdir[PDX(KERNBASE)];
 
+	if (pse_enabled)
+		lcr4(rcr4() | CR4_PSE);
+
 	// Install page table.
 	lcr3(boot_cr3);
 
@@ -267,7 +599,34 @@ i386_vm_init(void)
 	pgdir[0] = 0;
 
 	// Flush the TLB for good measure, to kill the pgdir[0] mapping.
-	lcr3(boot_cr3);
+	// From here on, VPT maps boot_pgdir's page tables.
+	pgdir_load(boot_pgdir);
+
+	// Only now turn on global pages: pgdir[0] was a copy of a global
+	// kernel mapping, and a CR3 reload would not have flushed it.
+	if (pte_global)
+		lcr4(rcr4() | CR4_PGE);
+
+	selftest_run("check_vpt_walk", check_vpt_walk, SELFTEST_QUICK);
+
+	// The idle loop may start pre-zeroing free pages now.
+	page_zero_ready = 1;
+}
+
+//
+// If there's a page that shouldn't be on the free list, try to make
+// sure it eventually causes trouble.  This touches every free page.
+//
+static void
+page_poison_free(void)
+{
+	struct Page *pp;
+	int i, o;
+
+	for (o = 0; o < PAGE_NORDER; o++)
+		PAGE_LIST_FOREACH(pp, &page_free_area[o])
+			for (i = 0; i < (1 << o); i++)
+				memset(page2kva(pp + i), 0x97, 128);
 }
 
 //
@@ -275,16 +634,11 @@ i386_vm_init(void)
 // and page_init()).
 //
 static void
-check_page_alloc()
+check_page_alloc(void)
 {
-	struct Page *pp, *pp0, *pp1, *pp2;
-	struct Page_list fl;
-	
-        // if there's a page that shouldn't be on
-        // the free list, try to make sure it
-        // eventually causes trouble.
-	LIST_FOREACH(pp0, &page_free_list, pp_link)
-		memset(page2kva(pp0), 0x97, 128);
+	struct Page *pp, *pp0, *pp1, *pp2, *pp3;
+	struct Page_list fl[PAGE_NORDER];
+	int i;
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -299,12 +653,32 @@ check_page_alloc()
         assert(page2pa(pp1) < npage*PGSIZE);
         assert(page2pa(pp2) < npage*PGSIZE);
 
+	// a multi-page block should be naturally aligned
+	pp3 = 0;
+	assert(page_alloc_order(2, &pp3) == 0);
+	assert(pp3 && (page2ppn(pp3) & 3) == 0);
+	assert(pp0 < pp3 || pp0 >= pp3 + 4);
+	assert(pp1 < pp3 || pp1 >= pp3 + 4);
+	assert(pp2 < pp3 || pp2 >= pp3 + 4);
+
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	LIST_INIT(&page_free_list);
+	page_free_steal(fl);
 
 	// should be no free memory
 	assert(page_alloc(&pp) == -E_NO_MEM);
+	assert(page_alloc_order(1, &pp) == -E_NO_MEM);
+
+	// freeing the block page by page should coalesce the buddies
+	// back into a single order-2 block
+	for (i = 0; i < 4; i++)
+		page_free(pp3 + i);
+	page_mag_drain();
+	assert((pp3->pp_flags & PP_FREE) && pp3->pp_order == 2);
+	// the merged buddies keep no links where their pp_ref is
+	for (i = 1; i < 4; i++)
+		assert(pp3[i].pp_ref == 0 && pp3[i].pp_flags == 0);
+	assert(page_alloc_order(2, &pp) == 0 && pp == pp3);
+	assert(page_alloc(&pp) == -E_NO_MEM);
 
         // free and re-allocate?
         page_free(pp0);
@@ -320,12 +694,13 @@ check_page_alloc()
 	assert(page_alloc(&pp) == -E_NO_MEM);
 
 	// give free list back
-	page_free_list = fl;
+	page_free_return(fl);
 
 	// free the pages we took
 	page_free(pp0);
 	page_free(pp1);
 	page_free(pp2);
+	page_free_order(pp3, 2);
 
 	cprintf("check_page_alloc() succeeded!\n");
 }
@@ -347,16 +722,20 @@ check_boot_pgdir(void)
 	pde_t *pgdir;
 
 	pgdir = boot_pgdir;
+	// Check one page per page table of the big mappings, and the
+	// last page; check_boot_pgdir_all() checks all of them.
 
 	// check pages array
 	n = ROUNDUP(npage*sizeof(struct Page), PGSIZE);
-	for (i = 0; i < n; i += PGSIZE)
+	for (i = 0; i < n; i += PTSIZE)
 		assert(check_va2pa(pgdir, UPAGES + i) == PADDR(pages) + i);
-	
+	assert(check_va2pa(pgdir, UPAGES + n - PGSIZE) == PADDR(pages) + n - PGSIZE);
 
 	// check phys mem
-	for (i = 0; i < npage * PGSIZE; i += PGSIZE)
+	for (i = 0; i < npage * PGSIZE; i += PTSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
+	i = (npage - 1) * PGSIZE;
+	assert(check_va2pa(pgdir, KERNBASE + i) == i);
 
 	// check kernel stack
 	for (i = 0; i < KSTKSIZE; i += PGSIZE)
@@ -382,6 +761,20 @@ check_boot_pgdir(void)
 	cprintf("check_boot_pgdir() succeeded!\n");
 }
 
+// check every page of the pages array and physical memory mappings
+static void
+check_boot_pgdir_all(void)
+{
+	uint32_t i, n;
+
+	n = ROUNDUP(npage*sizeof(struct Page), PGSIZE);
+	for (i = 0; i < n; i += PGSIZE)
+		assert(check_va2pa(boot_pgdir, UPAGES + i) == PADDR(pages) + i);
+	for (i = 0; i < npage * PGSIZE; i += PGSIZE)
+		assert(check_va2pa(boot_pgdir, KERNBASE + i) == i);
+	cprintf("check_boot_pgdir_all() succeeded!\n");
+}
+
 // This function returns the physical address of the page containing 'va',
 // defined by the page directory 'pgdir'.  The hardware normally performs
 // this functionality for us!  We define our own version to help check
@@ -395,6 +788,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return PDE_LARGE_ADDR(*pgdir) + (PTX(va) << PTXSHIFT);
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -429,11 +824,75 @@ page_init(void)
 	//     Which pages are used for page tables and other data structures?
 	//
 	// Change the code to reflect this.
-	int i;
-	LIST_INIT(&page_free_list);
+	size_t i, start, end, kernend;
+
+	static_assert(sizeof(struct Page) == 8);
+	// Page numbers must fit in the 20-bit free list links.
+	assert(npage <= PAGE_NIL);
+
+	for (i = 0; i < PAGE_NORDER; i++)
+		page_list_init(&page_free_area[i]);
+	page_list_init(&page_zero_list);
+	page_nzero = 0;
+	page_list_init(&pgtable_quick);
+	pgtable_nquick = 0;
+	for (i = 0; i < PAGE_NCOLOR; i++) {
+		page_list_init(&page_color_lists[i]);
+		page_color_count[i] = 0;
+	}
+	page_ncolored = 0;
+	for (i = 0; i < PGDIR_NLOCK; i++)
+		spin_initlock(&pgdir_locks[i], "pgdir_lock");
 	for (i = 0; i < npage; i++) {
 		pages[i].pp_ref = 0;
-		LIST_INSERT_HEAD(&page_free_list, &pages[i], pp_link);
+		pages[i].pp_flags = 0;
+	}
+
+	// Every usable range of the memory map, except for page 0, the
+	// IO hole, and the kernel and the boot_alloc'ed structures
+	// (boot_pgdir, pages[]) at the start of extended memory.
+	// Holes in the map stay in use.
+	kernend = PPN(ROUNDUP(PADDR(boot_freemem), PGSIZE));
+	for (i = 0; i < nmem_ranges; i++) {
+		start = PPN(mem_ranges[i].mr_start);
+		end = PPN(mem_ranges[i].mr_end);
+		page_free_range(MAX(start, (size_t) 1),
+				MIN(end, (size_t) PPN(IOPHYSMEM)));
+		page_free_range(MAX(start, kernend), end);
+	}
+}
+
+//
+// Push the block of 2^order pages headed by 'pp' onto its buddy free
+// list, without trying to coalesce it.
+//
+static void
+page_push_free(struct Page *pp, int order)
+{
+	pp->pp_ref = 0;
+	pp->pp_order = order;
+	pp->pp_flags = PP_FREE;
+	page_list_insert_head(&page_free_area[order], pp);
+}
+
+//
+// Add the free physical pages [start, end) (page numbers) to the
+// buddy free lists, cut into the largest naturally aligned blocks
+// that fit.  Used by page_init().
+//
+static void
+page_free_range(size_t start, size_t end)
+{
+	int order;
+
+	while (start < end) {
+		order = 0;
+		while (order < PAGE_MAX_ORDER
+		       && (start & ((2 << order) - 1)) == 0
+		       && start + (2 << order) <= end)
+			order++;
+		page_push_free(&pages[start], order);
+		start += 1 << order;
 	}
 }
 
@@ -460,13 +919,117 @@ page_initpp(struct Page *pp)
 //   0 -- on success
 //   -E_NO_MEM -- otherwise 
 //
-// Hint: use LIST_FIRST, LIST_REMOVE, and page_initpp
+// Hint: use page_list_first, page_list_remove, and page_initpp
 // Hint: pp_ref should not be incremented 
 int
 page_alloc(struct Page **pp_store)
 {
-	// Fill this function in
-	return -E_NO_MEM;
+	return pmap_stat_alloc(page_alloc_nostat(pp_store), 1);
+}
+
+//
+// page_alloc() without the counting, for the allocator's own use.
+//
+static int
+page_alloc_nostat(struct Page **pp_store)
+{
+	struct PageMagazine *mag = &page_mags[cpunum()];
+	struct Page *pp;
+	int r;
+
+	if (page_color_mode) {
+		page_mag_drain();
+		return page_color_take(mag->pm_color++ % PAGE_NCOLOR,
+				       pp_store);
+	}
+	if (mag->pm_count > 0)
+		mag->pm_hits++;
+	else {
+		mag->pm_misses++;
+		page_mag_refill(mag);
+		if (mag->pm_count == 0) {
+			// Last resort: the pre-zeroed pool.
+			spin_lock(&page_lock);
+			r = page_zero_take(pp_store);
+			spin_unlock(&page_lock);
+			return r;
+		}
+	}
+	pp = mag->pm_pages[--mag->pm_count];
+	page_initpp(pp);
+	*pp_store = pp;
+	return 0;
+}
+
+//
+// Allocates a naturally aligned block of 2^order physically contiguous
+// pages.  The smallest free block that is big enough is split in half
+// repeatedly; the upper halves go back on the free lists.
+//
+// *pp_store is set to the Page struct of the first page in the block.
+// As with page_alloc, the contents of the pages are not touched, and
+// every page in the block has a pp_ref of 0.  Free the block with
+// page_free_order() and the same order.
+//
+// RETURNS 
+//   0 -- on success
+//   -E_NO_MEM -- if there is no free block of at least 2^order pages
+//   -E_INVAL -- if order is out of range
+//
+int
+page_alloc_order(int order, struct Page **pp_store)
+{
+	int r;
+
+	if (order < 0 || order > PAGE_MAX_ORDER)
+		return -E_INVAL;
+
+	spin_lock(&page_lock);
+	r = page_buddy_alloc(order, pp_store);
+	spin_unlock(&page_lock);
+	if (r == 0)
+		return pmap_stat_alloc(0, 1 << order);
+
+	// The pages parked in this CPU's magazine, the zero pool, the
+	// page table quicklist and the color lists might complete a block
+	// once they go back to the buddy lists.
+	page_mag_drain();
+	spin_lock(&page_lock);
+	page_zero_drain();
+	pgtable_quick_drain();
+	page_color_drain();
+	r = page_buddy_alloc(order, pp_store);
+	spin_unlock(&page_lock);
+	return pmap_stat_alloc(r, 1 << order);
+}
+
+//
+// Take a block of 2^order pages straight off the buddy lists.
+// The caller holds page_lock.
+//
+static int
+page_buddy_alloc(int order, struct Page **pp_store)
+{
+	struct Page *pp;
+	int o;
+
+	for (o = order; o < PAGE_NORDER; o++)
+		if (!page_list_empty(&page_free_area[o]))
+			break;
+	if (o == PAGE_NORDER)
+		return -E_NO_MEM;
+
+	pp = page_list_first(&page_free_area[o]);
+	page_list_remove(&page_free_area[o], pp);
+	while (o > order) {
+		o--;
+		page_push_free(pp + (1 << o), o);
+	}
+	// Any page of the block may have headed a free block before,
+	// leaving its order and links behind.
+	memset(pp, 0, (1 << order) * sizeof(*pp));
+	*pp_store = pp;
+	return 0;
 }
 
 //
@@ -476,165 +1039,2188 @@ page_alloc(struct Page **pp_store)
 void
 page_free(struct Page *pp)
 {
-	// Fill this function in
+	struct PageMagazine *mag = &page_mags[cpunum()];
+
+	if (pp->pp_flags & (PP_FREE | PP_CACHED | PP_ZERO))
+		panic("page_free: page %08x is already free", page2pa(pp));
+	PMAP_STAT(ps_page_free);
+	if (page_color_mode) {
+		page_free_color(pp);
+		return;
+	}
+	if (mag->pm_count == PAGE_MAG_SIZE)
+		page_mag_flush(mag, PAGE_MAG_BATCH);
+	pp->pp_flags = PP_CACHED;
+	mag->pm_pages[mag->pm_count++] = pp;
 }
 
 //
-// Decrement the reference count on a page,
-// freeing it if there are no more refs.
+// Return the block of 2^order pages headed by 'pp', as allocated by
+// page_alloc_order(), to the free lists.  While the block's buddy
+// (the other half of the next larger block) is free as a whole, the
+// two are merged, so free memory does not stay fragmented.
 //
 void
-page_decref(struct Page* pp)
+page_free_order(struct Page *pp, int order)
 {
-	if (--pp->pp_ref == 0)
-		page_free(pp);
+	PMAP_STAT_ADD(ps_page_free, 1 << order);
+	spin_lock(&page_lock);
+	page_buddy_free(pp, order);
+	spin_unlock(&page_lock);
 }
 
-// Given 'pgdir', a pointer to a page directory, pgdir_walk returns
-// a pointer to the page table entry (PTE) for linear address 'va'.
-// This requires walking the two-level page table structure.
-//
-// If the relevant page table doesn't exist in the page directory, then:
-//    - If create == 0, pgdir_walk returns NULL.
-//    - Otherwise, pgdir_walk tries to allocate a new page table
-//	with page_alloc.  If this fails, pgdir_walk returns NULL.
-//    - pgdir_walk sets pp_ref to 1 for the new page table.
-//    - pgdir_walk clears the new page table.
-//    - Finally, pgdir_walk returns a pointer into the new page table.
 //
-// Hint: you can turn a Page * into the physical address of the
-// page it refers to with page2pa() from kern/pmap.h.
+// page_free_order() for callers that hold page_lock.
 //
-// Hint 2: the x86 MMU checks permission bits in both the page directory
-// and the page table, so it's safe to leave permissions in the page
-// more permissive than strictly necessary.
-pte_t *
-pgdir_walk(pde_t *pgdir, const void *va, int create)
+static void
+page_buddy_free(struct Page *pp, int order)
 {
-	// Fill this function in
-	return NULL;
+	ppn_t ppn, buddy;
+
+	ppn = page2ppn(pp);
+	if (pp->pp_flags & (PP_FREE | PP_CACHED | PP_ZERO))
+		panic("page_free: page %08x is already free", page2pa(pp));
+	assert(order >= 0 && order <= PAGE_MAX_ORDER);
+	assert((ppn & ((1 << order) - 1)) == 0);
+
+	for (; order < PAGE_MAX_ORDER; order++) {
+		buddy = ppn ^ (1 << order);
+		if (buddy >= npage
+		    || !(pages[buddy].pp_flags & PP_FREE)
+		    || pages[buddy].pp_order != order)
+			break;
+		// Leaves pp_ref 0 and the flags clear: only the head of
+		// the merged block is marked.
+		page_list_remove(&page_free_area[order], &pages[buddy]);
+		pages[buddy].pp_flags = 0;
+		ppn &= ~(1 << order);
+	}
+	page_push_free(&pages[ppn], order);
 }
 
 //
-// Map the physical page 'pp' at virtual address 'va'.
-// The permissions (the low 12 bits) of the page table
-//  entry should be set to 'perm|PTE_P'.
-//
-// Requirements
-//   - If there is already a page mapped at 'va', it should be page_remove()d.
-//   - If necessary, on demand, a page table should be allocated and inserted
-//     into 'pgdir'.
-//   - pp->pp_ref should be incremented if the insertion succeeds.
-//   - The TLB must be invalidated if a page was formerly present at 'va'.
+// Allocates n single physical pages at once, storing their Page
+// structs in out[0..n-1].  As with page_alloc, the pages' contents
+// are not touched.  Whole buddy blocks are taken off the free lists
+// and broken up in one go, so the number of list operations grows
+// with the number of blocks rather than the number of pages, and
+// pages that come from the same block are physically contiguous and
+// in ascending order.
 //
-// Corner-case hint: Make sure to consider what happens when the same 
-// pp is re-inserted at the same virtual address in the same pgdir.
+// RETURNS 
+//   0 -- on success
+//   -E_NO_MEM -- if fewer than n pages are free; nothing is allocated
 //
-// RETURNS: 
-//   0 on success
-//   -E_NO_MEM, if page table couldn't be allocated
+int
+page_alloc_batch(struct Page **out, size_t n)
+{
+	return pmap_stat_alloc(page_alloc_batch_nostat(out, n), n);
+}
+
 //
-// Hint: The TA solution is implemented using pgdir_walk, page_remove,
-// and page2pa.
+// page_alloc_batch() without the counting, for the allocator's own use.
 //
-int
-page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm) 
+static int
+page_alloc_batch_nostat(struct Page **out, size_t n)
 {
-	// Fill this function in
+	struct PageMagazine *mag = &page_mags[cpunum()];
+	size_t i;
+
+	// Use up the cache-hot pages first, unless coloring is on (see
+	// page_color_mode).
+	if (page_color_mode)
+		page_mag_drain();
+	for (i = 0; i < n && mag->pm_count > 0; i++) {
+		out[i] = mag->pm_pages[--mag->pm_count];
+		page_initpp(out[i]);
+	}
+	spin_lock(&page_lock);
+	i += page_buddy_alloc_batch(out + i, n - i);
+	while (i < n && page_zero_take(&out[i]) == 0)
+		i++;
+	if (i < n) {
+		// Put them back without counting them as freed.
+		page_buddy_free_batch(out, i);
+		spin_unlock(&page_lock);
+		return -E_NO_MEM;
+	}
+	spin_unlock(&page_lock);
 	return 0;
 }
 
 //
-// Map [la, la+size) of linear address space to physical [pa, pa+size)
-// in the page table rooted at pgdir.  Size is a multiple of PGSIZE.
-// Use permission bits perm|PTE_P for the entries.
-//
-// This function is only intended to set up the ``static'' mappings
-// above UTOP. As such, it should *not* change the pp_ref field on the
-// mapped pages.
+// Frees the n pages in pps[], like calling page_free() on each.
+// The pages bypass the magazine and go straight back to the buddy
+// lists: runs of physically consecutive pages are returned as whole
+// blocks, so freeing a range that page_alloc_batch() handed out costs
+// about one list operation per block.
 //
-// Hint: the TA solution uses pgdir_walk
-static void
-boot_map_segment(pde_t *pgdir, uintptr_t la, size_t size, physaddr_t pa, int perm)
+void
+page_free_batch(struct Page **pps, size_t n)
 {
-	// Fill this function in
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (pps[i]->pp_flags & (PP_FREE | PP_CACHED | PP_ZERO))
+			panic("page_free_batch: page %08x is already free",
+			      page2pa(pps[i]));
+	PMAP_STAT_ADD(ps_page_free, n);
+	spin_lock(&page_lock);
+	page_buddy_free_batch(pps, n);
+	spin_unlock(&page_lock);
 }
 
 //
-// Return the page mapped at virtual address 'va'.
-// If pte_store is not zero, then we store in it the address
-// of the pte for this page.  This is used by page_remove
-// but should not be used by other callers.
+// Take up to n single pages off the buddy lists, breaking whole blocks
+// up at once instead of splitting them one order at a time.
+// Returns the number of pages stored in out[].  The caller holds
+// page_lock.
 //
-// Return NULL if there is no page mapped at va.
+static size_t
+page_buddy_alloc_batch(struct Page **out, size_t n)
+{
+	struct Page *pp;
+	size_t i, k;
+	int o;
+
+	i = 0;
+	o = PAGE_MAX_ORDER;
+	while (i < n && o >= 0) {
+		// Largest block that still fits in what is left.
+		while ((1 << o) > n - i)
+			o--;
+		if (page_buddy_alloc(o, &pp) < 0) {
+			// Nothing of order o or above is left.
+			o--;
+			continue;
+		}
+		for (k = 0; k < (1 << o); k++)
+			out[i++] = pp + k;
+	}
+	return i;
+}
+
 //
-// Hint: the TA solution uses pgdir_walk and pa2page.
+// Return the n pages in pps[] to the buddy lists.  Each run of
+// physically consecutive pages is freed as the largest naturally
+// aligned blocks that it contains.  The caller holds page_lock.
 //
-struct Page *
-page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
+static void
+page_buddy_free_batch(struct Page **pps, size_t n)
 {
-	// Fill this function in
-	return NULL;
+	size_t i, run, left;
+	ppn_t ppn;
+	int order;
+
+	for (i = 0; i < n; i += run) {
+		for (run = 1; i + run < n && pps[i + run] == pps[i] + run; run++)
+			/* do nothing */;
+		ppn = page2ppn(pps[i]);
+		for (left = run; left > 0; left -= 1 << order) {
+			order = 0;
+			while (order < PAGE_MAX_ORDER
+			       && (ppn & ((2 << order) - 1)) == 0
+			       && (2 << order) <= left)
+				order++;
+			page_buddy_free(&pages[ppn], order);
+			ppn += 1 << order;
+		}
+	}
 }
 
 //
-// Unmaps the physical page at virtual address 'va'.
-// If there is no physical page at that address, silently does nothing.
+// Fill an empty magazine with up to PAGE_MAG_BATCH pages from the
+// buddy lists.
 //
-// Details:
-//   - The ref count on the physical page should decrement.
-//   - The physical page should be freed if the refcount reaches 0.
-//   - The pg table entry corresponding to 'va' should be set to 0.
-//     (if such a PTE exists)
-//   - The TLB must be invalidated if you remove an entry from
-//     the pg dir/pg table.
+static void
+page_mag_refill(struct PageMagazine *mag)
+{
+	int i;
+
+	spin_lock(&page_lock);
+	mag->pm_count = page_buddy_alloc_batch(mag->pm_pages, PAGE_MAG_BATCH);
+	spin_unlock(&page_lock);
+	for (i = 0; i < mag->pm_count; i++)
+		mag->pm_pages[i]->pp_flags = PP_CACHED;
+	// An empty buddy list is a miss, not a refill.
+	if (mag->pm_count > 0)
+		mag->pm_refills++;
+}
+
 //
-// Hint: The TA solution is implemented using page_lookup,
-// 	tlb_invalidate, and page_decref.
+// Give the n oldest (least cache-hot) pages in 'mag' back to the
+// buddy lists, where they can coalesce again.
 //
-void
-page_remove(pde_t *pgdir, void *va)
+static void
+page_mag_flush(struct PageMagazine *mag, int n)
 {
-	// Fill this function in
+	int i;
+
+	n = MIN(n, mag->pm_count);
+	if (n == 0)
+		return;
+	for (i = 0; i < n; i++)
+		mag->pm_pages[i]->pp_flags = 0;
+	spin_lock(&page_lock);
+	page_buddy_free_batch(mag->pm_pages, n);
+	spin_unlock(&page_lock);
+	memmove(mag->pm_pages, mag->pm_pages + n,
+		(mag->pm_count - n) * sizeof(mag->pm_pages[0]));
+	mag->pm_count -= n;
+	mag->pm_drains++;
 }
 
 //
-// Invalidate a TLB entry, but only if the page tables being
-// edited are the ones currently in use by the processor.
+// Empty the current CPU's page magazine into the buddy lists.
 //
 void
-tlb_invalidate(pde_t *pgdir, void *va)
+page_mag_drain(void)
 {
-	// Flush the entry only if we're modifying the current address space.
-	// For now, there is only one address space, so always invalidate.
-	invlpg(va);
+	struct PageMagazine *mag = &page_mags[cpunum()];
+
+	if (mag->pm_count > 0)
+		page_mag_flush(mag, mag->pm_count);
 }
 
-// check page_insert, page_remove, &c
-static void
-page_check(void)
+//
+// Print the per-CPU page magazine counters.
+//
+void
+page_mag_print_stats(void)
 {
-	struct Page *pp, *pp0, *pp1, *pp2;
-	struct Page_list fl;
-	pte_t *ptep, *ptep1;
-	void *va;
+	struct PageMagazine *mag;
+	uint32_t total, pct;
 	int i;
 
-	// should be able to allocate three pages
-	pp0 = pp1 = pp2 = 0;
-	assert(page_alloc(&pp0) == 0);
-	assert(page_alloc(&pp1) == 0);
-	assert(page_alloc(&pp2) == 0);
-
-	assert(pp0);
-	assert(pp1 && pp1 != pp0);
-	assert(pp2 && pp2 != pp1 && pp2 != pp0);
-
-	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	LIST_INIT(&page_free_list);
+	for (i = 0; i < NCPU; i++) {
+		mag = &page_mags[i];
+		total = mag->pm_hits + mag->pm_misses;
+		if (total == 0)
+			continue;
+		// avoid 64-bit division: hits <= total
+		if (mag->pm_hits < 0x1000000)
+			pct = mag->pm_hits * 100 / total;
+		else
+			pct = mag->pm_hits / (total / 100);
+		cprintf("cpu %d: %d cached, %u allocs, %u%% hits, "
+			"%u refills, %u drains\n", i, mag->pm_count, total,
+			pct, mag->pm_refills, mag->pm_drains);
+	}
+}
 
-	// should be no free memory
+//
+// Allocates a physical page of the given cache color, i.e. whose
+// physical page number is 'color' modulo PAGE_NCOLOR.  A caller that
+// knows the virtual address the page is for can pass PPN(va) %
+// PAGE_NCOLOR.  If no free PAGE_NCOLOR-page block is left to refill
+// the color's list, any free page is used instead.  As with
+// page_alloc, the page's contents are not touched.
+//
+// RETURNS 
+//   0 -- on success
+//   -E_NO_MEM -- otherwise 
+//
+int
+page_alloc_color(int color, struct Page **pp_store)
+{
+	return pmap_stat_alloc(page_color_take(color, pp_store), 1);
+}
+
+//
+// page_alloc_color() without the counting, for page_alloc().
+//
+static int
+page_color_take(int color, struct Page **pp_store)
+{
+	struct Page *pp;
+	int i, r;
+
+	assert(color >= 0 && color < PAGE_NCOLOR);
+	spin_lock(&page_lock);
+	if (page_list_empty(&page_color_lists[color])
+	    && page_buddy_alloc(PAGE_COLOR_ORDER, &pp) == 0) {
+		// One page of each color, except for colors whose list
+		// is already full.
+		for (i = 0; i < PAGE_NCOLOR; i++) {
+			if (page_color_count[i] >= PAGE_COLOR_MAX) {
+				page_buddy_free(&pp[i], 0);
+				continue;
+			}
+			pp[i].pp_flags = PP_CACHED;
+			page_list_insert_head(&page_color_lists[i], &pp[i]);
+			page_color_count[i]++;
+			page_ncolored++;
+		}
+	}
+
+	if ((pp = page_list_first(&page_color_lists[color])) != NULL) {
+		page_list_remove(&page_color_lists[color], pp);
+		page_color_count[color]--;
+		page_ncolored--;
+		page_color_hits++;
+		r = 0;
+	} else {
+		// Memory is fragmented: settle for the wrong color.
+		for (i = 0; i < PAGE_NCOLOR; i++)
+			if ((pp = page_list_first(&page_color_lists[i]))) {
+				page_list_remove(&page_color_lists[i], pp);
+				page_color_count[i]--;
+				page_ncolored--;
+				break;
+			}
+		r = pp ? 0 : page_buddy_alloc(0, &pp);
+		if (r == 0)
+			page_color_misses++;
+	}
+	spin_unlock(&page_lock);
+	if (r < 0)
+		return r;
+	page_initpp(pp);
+	*pp_store = pp;
+	return 0;
+}
+
+//
+// page_free() for page_color_mode: put 'pp' on its color list, or back
+// on the buddy lists if that list is already long.
+//
+static void
+page_free_color(struct Page *pp)
+{
+	int color = page2ppn(pp) % PAGE_NCOLOR;
+
+	spin_lock(&page_lock);
+	if (page_color_count[color] < PAGE_COLOR_MAX) {
+		pp->pp_flags = PP_CACHED;
+		page_list_insert_head(&page_color_lists[color], pp);
+		page_color_count[color]++;
+		page_ncolored++;
+	} else
+		page_buddy_free(pp, 0);
+	spin_unlock(&page_lock);
+}
+
+//
+// Give every page on the color lists back to the buddy lists.
+// The caller holds page_lock.
+//
+static void
+page_color_drain(void)
+{
+	struct Page *pp;
+	int i;
+
+	for (i = 0; i < PAGE_NCOLOR; i++) {
+		while ((pp = page_list_first(&page_color_lists[i])) != NULL) {
+			page_list_remove(&page_color_lists[i], pp);
+			pp->pp_flags = 0;
+			page_buddy_free(pp, 0);
+		}
+		page_color_count[i] = 0;
+	}
+	page_ncolored = 0;
+}
+
+//
+// Turn page coloring on or off.  Turning it off returns the pages on
+// the color lists to the buddy lists.  Turning it on does the same for
+// the pre-zeroed pool, which knows nothing of colors and so goes
+// unused while coloring is on.  Either way this CPU's page magazine
+// is emptied; other CPUs empty theirs when they next allocate.
+//
+void
+page_color_set(int on)
+{
+	page_mag_drain();
+	spin_lock(&page_lock);
+	page_color_mode = on;
+	if (on)
+		page_zero_drain();
+	else
+		page_color_drain();
+	spin_unlock(&page_lock);
+}
+
+//
+// Print the page coloring counters.
+//
+void
+page_color_print_stats(void)
+{
+	cprintf("page coloring %s: %d colors, %u pages on color lists, "
+		"%u hits, %u misses\n", page_color_mode ? "on" : "off",
+		PAGE_NCOLOR, page_ncolored, page_color_hits,
+		page_color_misses);
+}
+
+//
+// Scan 'npage' pages mapped at 'va', reading PAGE_COLOR_BENCH_LINES
+// cache lines at the start of each, 'rounds' times over.  Returns the
+// cycles per page.  With a physically indexed cache, the lines of pages
+// of the same color land in the same sets, so the scan slows down once
+// a color has more pages than the cache has ways.
+//
+static uint32_t
+page_color_scan(volatile uint32_t *va, size_t npage, int rounds)
+{
+	uint64_t tsc;
+	size_t i, j;
+	uint32_t sum;
+	int r;
+
+	sum = 0;
+	// Warm up, so that the first round doesn't count TLB misses.
+	for (i = 0; i < npage; i++)
+		sum += va[i * (PGSIZE / 4)];
+	tsc = read_tsc();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < npage; i++)
+			for (j = 0; j < PAGE_COLOR_BENCH_LINES; j++)
+				sum += va[i * (PGSIZE / 4) + j * (CACHE_LINE / 4)];
+	tsc = read_tsc() - tsc;
+	(void) sum;
+	// avoid 64-bit division: saturate runs too long for 32 bits
+	if (tsc >> 32)
+		return ~0;
+	return (uint32_t) tsc / (npage * rounds);
+}
+
+//
+// Benchmark page coloring: map 'npage' pages at a scratch address and
+// time a strided scan over them (see page_color_scan()).  The pages
+// come from the plain allocator, from a single color (the worst case
+// for an uncolored allocator), and from the coloring allocator.
+//
+void
+page_color_bench(size_t npage, int rounds)
+{
+	static struct Page *bench_pages[PAGE_COLOR_BENCH_MAX];
+	static const char *const names[3] = {
+		"default", "one color", "rotating colors"
+	};
+	void *va = (void *) UTEXT;
+	int mode, oldmode, r;
+	size_t i, got, misses;
+
+	npage = MIN(npage, PAGE_COLOR_BENCH_MAX);
+	pgdir_lock(boot_pgdir);
+	r = boot_pgdir[PDX(va)] & PTE_P;
+	pgdir_unlock(boot_pgdir);
+	if (r) {
+		cprintf("page_color_bench: %08x is in use\n", va);
+		return;
+	}
+	oldmode = page_color_mode;
+	for (mode = 0; mode < 3; mode++) {
+		page_color_set(mode == 2);
+		misses = 0;
+		for (got = 0; got < npage; got++) {
+			if (mode == 1)
+				r = page_alloc_color(0, &bench_pages[got]);
+			else
+				r = page_alloc(&bench_pages[got]);
+			if (r < 0)
+				break;
+			// page_alloc_color() settles for other colors
+			// when memory is short, which would spoil the
+			// one color case.
+			if (mode == 1 && page2ppn(bench_pages[got]) % PAGE_NCOLOR)
+				misses++;
+		}
+		if (got == npage && misses == 0
+		    && page_insert_range(boot_pgdir, bench_pages, npage, va,
+					 PTE_W) == 0) {
+			cprintf("%-16s %u cycles/page\n", names[mode],
+				page_color_scan(va, npage, rounds));
+			page_remove_range(boot_pgdir, va, npage * PGSIZE);
+		} else {
+			cprintf("%-16s out of memory\n", names[mode]);
+			for (i = 0; i < got; i++)
+				page_free(bench_pages[i]);
+		}
+	}
+	page_color_set(oldmode);
+
+	// page_remove_range() leaves the page table.
+	pgdir_lock(boot_pgdir);
+	if (boot_pgdir[PDX(va)] & PTE_P) {
+		pgtable_free(pa2page(PTE_ADDR(boot_pgdir[PDX(va)])));
+		boot_pgdir[PDX(va)] = 0;
+		tlb_invalidate(boot_pgdir, va);
+	}
+	pgdir_unlock(boot_pgdir);
+}
+
+//
+// Allocates a physical page whose contents are all zero, like
+// page_alloc() followed by memset(page2kva(pp), 0, PGSIZE).
+// Pages cleared ahead of time by page_zero_idle() are used first,
+// so that the fault and page table paths rarely pay for the memset.
+// In page_color_mode the pool is skipped, so that zeroed pages get
+// rotating colors like any others.
+//
+// RETURNS 
+//   0 -- on success
+//   -E_NO_MEM -- otherwise 
+//
+int
+page_alloc_zeroed(struct Page **pp_store)
+{
+	int r;
+
+	spin_lock(&page_lock);
+	if (!page_color_mode && page_zero_take(pp_store) == 0) {
+		page_zero_hits++;
+		spin_unlock(&page_lock);
+		return pmap_stat_alloc(0, 1);
+	}
+	page_zero_misses++;
+	spin_unlock(&page_lock);
+	if ((r = page_alloc_nostat(pp_store)) == 0)
+		memset(page2kva(*pp_store), 0, PGSIZE);
+	return pmap_stat_alloc(r, 1);
+}
+
+//
+// Take a page from the pre-zeroed pool.  The caller holds page_lock.
+//
+static int
+page_zero_take(struct Page **pp_store)
+{
+	struct Page *pp;
+
+	if ((pp = page_list_first(&page_zero_list)) == NULL)
+		return -E_NO_MEM;
+	page_list_remove(&page_zero_list, pp);
+	page_nzero--;
+	page_initpp(pp);
+	*pp_store = pp;
+	return 0;
+}
+
+//
+// Called whenever the CPU is idle (e.g., while the kernel monitor
+// waits for input).  Clears one free page and moves it to the
+// pre-zeroed pool, until the pool holds PAGE_ZERO_TARGET pages.
+// One page per call keeps the added input latency small.
+// Nothing is done in page_color_mode, where the pool goes unused
+// (and page_alloc() would advance the color rotation).
+//
+void
+page_zero_idle(void)
+{
+	struct Page *pp;
+
+	if (!page_zero_ready || page_color_mode
+	    || page_nzero >= PAGE_ZERO_TARGET)
+		return;
+	if (page_alloc_nostat(&pp) < 0)
+		return;
+	memset(page2kva(pp), 0, PGSIZE);
+	spin_lock(&page_lock);
+	pp->pp_flags = PP_ZERO;
+	page_list_insert_head(&page_zero_list, pp);
+	page_nzero++;
+	spin_unlock(&page_lock);
+}
+
+//
+// Give every page in the pre-zeroed pool back to the buddy lists.
+// The caller holds page_lock.
+//
+static void
+page_zero_drain(void)
+{
+	struct Page *pp;
+
+	while ((pp = page_list_first(&page_zero_list)) != NULL) {
+		page_list_remove(&page_zero_list, pp);
+		pp->pp_flags = 0;
+		page_buddy_free(pp, 0);
+	}
+	page_nzero = 0;
+}
+
+//
+// Print the pre-zeroed pool counters.
+//
+void
+page_zero_print_stats(void)
+{
+	cprintf("zero pool: %d pages, %u hits, %u misses\n",
+		page_nzero, page_zero_hits, page_zero_misses);
+}
+
+//
+// Refill the page table quicklist with up to PGTABLE_QUICK_BATCH
+// cleared pages, preferring those the idle loop has already cleared.
+// Settles for a single page when memory is tight.  Called without
+// page_lock, since it allocates through page_alloc_batch().
+//
+static int
+pgtable_quick_refill(void)
+{
+	struct Page *batch[PGTABLE_QUICK_BATCH];
+	int i, n, nzero;
+
+	spin_lock(&page_lock);
+	for (n = 0; n < PGTABLE_QUICK_BATCH; n++)
+		if (page_zero_take(&batch[n]) < 0)
+			break;
+	spin_unlock(&page_lock);
+	nzero = n;
+	if (n < PGTABLE_QUICK_BATCH) {
+		if (page_alloc_batch_nostat(batch + n,
+					    PGTABLE_QUICK_BATCH - n) == 0)
+			n = PGTABLE_QUICK_BATCH;
+		else if (n == 0 && page_alloc_nostat(&batch[0]) == 0)
+			n = 1;
+	}
+	if (n == 0)
+		return -E_NO_MEM;
+
+	for (i = nzero; i < n; i++)
+		memset(page2kva(batch[i]), 0, PGSIZE);
+	spin_lock(&page_lock);
+	for (i = 0; i < n; i++) {
+		batch[i]->pp_flags = PP_ZERO;
+		page_list_insert_head(&pgtable_quick, batch[i]);
+	}
+	pgtable_nquick += n;
+	pgtable_refills++;
+	spin_unlock(&page_lock);
+	return 0;
+}
+
+//
+// Allocate a cleared page for use as a page table.
+// Does NOT set pp_ref.
+//
+static int
+pgtable_alloc(struct Page **pp_store)
+{
+	struct Page *pp;
+
+	spin_lock(&page_lock);
+	// Another CPU may empty the list again between the refill and
+	// our taking the lock back.
+	while (pgtable_nquick == 0) {
+		spin_unlock(&page_lock);
+		if (pgtable_quick_refill() < 0)
+			return -E_NO_MEM;
+		spin_lock(&page_lock);
+	}
+	pp = page_list_first(&pgtable_quick);
+	page_list_remove(&pgtable_quick, pp);
+	pgtable_nquick--;
+	page_initpp(pp);
+	pp->pp_flags = PP_PGTABLE;
+	pgtable_allocs++;
+	spin_unlock(&page_lock);
+	*pp_store = pp;
+	return 0;
+}
+
+//
+// Move the oldest 'n' pages off the quicklist: into the zero pool while
+// it has room, since they are already clear, and the rest back to the
+// buddy lists.  The caller holds page_lock.
+//
+static void
+pgtable_quick_trim(size_t n)
+{
+	struct Page *pp, *prev;
+
+	if ((pp = page_list_first(&pgtable_quick)) == NULL)
+		return;
+	while (page_list_next(pp))
+		pp = page_list_next(pp);
+	for (; n > 0 && pp; n--, pp = prev) {
+		prev = pp->pp_prev == PAGE_NIL ? NULL : &pages[pp->pp_prev];
+		page_list_remove(&pgtable_quick, pp);
+		pgtable_nquick--;
+		if (page_nzero < PAGE_ZERO_TARGET) {
+			page_list_insert_head(&page_zero_list, pp);
+			page_nzero++;
+		} else {
+			pp->pp_flags = 0;
+			page_buddy_free(pp, 0);
+		}
+	}
+	pgtable_trims++;
+}
+
+//
+// Give every page on the quicklist back to the buddy lists.
+// The caller holds page_lock.
+//
+static void
+pgtable_quick_drain(void)
+{
+	struct Page *pp;
+
+	while ((pp = page_list_first(&pgtable_quick)) != NULL) {
+		page_list_remove(&pgtable_quick, pp);
+		pp->pp_flags = 0;
+		page_buddy_free(pp, 0);
+	}
+	pgtable_nquick = 0;
+}
+
+//
+// Release page table 'pp' once its page directory entry has been
+// cleared.  Every entry in the table must already be zero, e.g.
+// because page_remove() took out all its mappings; the page goes
+// back on the quicklist as is, for the next pgdir_walk() to reuse.
+//
+void
+pgtable_free(struct Page *pp)
+{
+#ifdef PAGE_REF_DEBUG
+	pte_t *pt;
+	int i;
+#endif
+
+	if (pp->pp_flags & ~PP_PGTABLE)
+		panic("pgtable_free: page %08x is already free", page2pa(pp));
+#ifdef PAGE_REF_DEBUG
+	// A leftover entry would leak its page's reference, and show up
+	// in the address space that reuses the table.
+	pt = page2kva(pp);
+	for (i = 0; i < NPTENTRIES; i++)
+		if (pt[i] != 0)
+			panic("pgtable_free: page table %08x maps %08x at %03x",
+			      page2pa(pp), pt[i], i);
+#endif
+	pp->pp_ref = 0;
+	spin_lock(&page_lock);
+	pp->pp_flags = PP_ZERO;
+	page_list_insert_head(&pgtable_quick, pp);
+	pgtable_nquick++;
+	pgtable_frees++;
+	if (pgtable_nquick > PGTABLE_QUICK_MAX)
+		pgtable_quick_trim(PGTABLE_QUICK_BATCH);
+	spin_unlock(&page_lock);
+}
+
+//
+// Print the page table quicklist counters.
+//
+void
+pgtable_print_stats(void)
+{
+	cprintf("page table quicklist: %d pages, %u allocs, %u frees, "
+		"%u refills, %u trims\n", pgtable_nquick, pgtable_allocs,
+		pgtable_frees, pgtable_refills, pgtable_trims);
+}
+
+//
+// Count the free pages: those on the buddy lists, in the per-CPU
+// magazines and color lists, in the pre-zeroed pool, and on the page
+// table quicklist.
+// The caller holds page_lock.
+//
+static size_t
+page_nfree(size_t *buddy_store, size_t *cached_store)
+{
+	struct Page *pp;
+	size_t buddy, cached;
+	int i;
+
+	buddy = 0;
+	for (i = 0; i < PAGE_NORDER; i++)
+		PAGE_LIST_FOREACH(pp, &page_free_area[i])
+			buddy += 1 << i;
+	cached = page_ncolored;
+	for (i = 0; i < NCPU; i++)
+		cached += page_mags[i].pm_count;
+	*buddy_store = buddy;
+	*cached_store = cached;
+	return buddy + cached + page_nzero + pgtable_nquick;
+}
+
+static void
+pmap_print_stats_line(const char *who, struct PmapStats *ps)
+{
+	cprintf("%-4s %10u %6u %9u %9u %6u %9u %9u %10u %6u\n", who,
+		ps->ps_page_alloc, ps->ps_page_alloc_fail, ps->ps_page_free,
+		ps->ps_pgdir_walk, ps->ps_pgtable_new, ps->ps_page_insert,
+		ps->ps_page_remove, ps->ps_tlb_invalidate, ps->ps_tlb_flush);
+}
+
+//
+// Print the memory-management counters, per CPU and in total, how
+// much memory is free, and what mapping KERNBASE at boot cost.
+//
+void
+pmap_print_stats(void)
+{
+	struct PmapStats *ps, total;
+	size_t nfree, buddy, cached;
+	char who[4];
+	int i;
+
+	memset(&total, 0, sizeof(total));
+	cprintf("cpu       alloc   fail      free      walk  newpt"
+		"    insert    remove     invlpg  flush\n");
+	for (i = 0; i < NCPU; i++) {
+		ps = &pmap_stats[i];
+		if (ps->ps_page_alloc == 0 && ps->ps_page_free == 0
+		    && ps->ps_pgdir_walk == 0 && ps->ps_tlb_invalidate == 0
+		    && ps->ps_tlb_flush == 0)
+			continue;
+		snprintf(who, sizeof(who), "%d", i);
+		pmap_print_stats_line(who, ps);
+		total.ps_page_alloc += ps->ps_page_alloc;
+		total.ps_page_alloc_fail += ps->ps_page_alloc_fail;
+		total.ps_page_free += ps->ps_page_free;
+		total.ps_pgdir_walk += ps->ps_pgdir_walk;
+		total.ps_pgtable_new += ps->ps_pgtable_new;
+		total.ps_page_insert += ps->ps_page_insert;
+		total.ps_page_remove += ps->ps_page_remove;
+		total.ps_tlb_invalidate += ps->ps_tlb_invalidate;
+		total.ps_tlb_flush += ps->ps_tlb_flush;
+	}
+	pmap_print_stats_line("all", &total);
+
+	spin_lock(&page_lock);
+	nfree = page_nfree(&buddy, &cached);
+	spin_unlock(&page_lock);
+	cprintf("free: %u of %u pages (%uKB): %u buddy, %u cached, "
+		"%u zeroed, %u page tables\n", nfree, npage,
+		nfree * (PGSIZE / 1024), buddy, cached, page_nzero,
+		pgtable_nquick);
+	cprintf("KERNBASE mapped in %u cycles, with %u 4MB pages "
+		"(%uK of page tables saved)\n", boot_map_cycles, boot_nlarge,
+		boot_nlarge * (PGSIZE / 1024));
+}
+
+//
+// Kinds of physical page told apart by page_print_map().
+//
+enum {
+	PM_FREE,		// On a free list, magazine, zero pool or quicklist
+	PM_ALLOC,		// Allocated through the page_* functions
+	PM_PGTABLE,		// Allocated as a page table by pgdir_walk()
+	PM_BOOT,		// Page 0, the kernel and boot_alloc()ed memory
+	PM_IOHOLE,		// [IOPHYSMEM, EXTPHYSMEM)
+	PM_RESERVED,		// Not usable according to the memory map
+	PM_NKIND
+};
+
+static const char *const pm_kind_names[PM_NKIND] = {
+	"free", "allocated", "page table", "boot", "IO hole", "reserved"
+};
+
+//
+// Print a run-length map of physical memory: one line per run of
+// pages of the same kind, up to 'maxruns' lines, then the page count
+// of each kind and the largest run of free pages.  The scan visits
+// each page once and prints nothing per page, so it stays cheap with
+// lots of memory.  It reads pages[] without page_lock, so pages that
+// change hands during the scan may be shown in either state.
+//
+void
+page_print_map(int maxruns)
+{
+	size_t count[PM_NKIND];
+	size_t i, start, kernend, freeleft, maxfree, maxfree_start;
+	int kind, runkind, nruns, m;
+
+	memset(count, 0, sizeof(count));
+	kernend = PPN(ROUNDUP(PADDR(boot_freemem), PGSIZE));
+	freeleft = maxfree = maxfree_start = 0;
+	nruns = m = 0;
+	runkind = -1;
+	start = 0;
+	for (i = 0; i <= npage; i++) {
+		if (i == npage)
+			kind = -1;
+		else if (i >= PPN(IOPHYSMEM) && i < PPN(EXTPHYSMEM))
+			kind = PM_IOHOLE;
+		else {
+			// mem_ranges[] is sorted, so one cursor suffices.
+			while (m < nmem_ranges && PPN(mem_ranges[m].mr_end) <= i)
+				m++;
+			if (m == nmem_ranges || PPN(mem_ranges[m].mr_start) > i)
+				kind = PM_RESERVED;
+			else if (i == 0 || (i >= PPN(EXTPHYSMEM) && i < kernend))
+				kind = PM_BOOT;
+			else if (pages[i].pp_flags & PP_FREE) {
+				// Only the head of a buddy block is marked.
+				freeleft = 1 << pages[i].pp_order;
+				kind = PM_FREE;
+			} else if (freeleft > 0
+				   || (pages[i].pp_flags & (PP_CACHED | PP_ZERO)))
+				kind = PM_FREE;
+			else if (pages[i].pp_flags & PP_PGTABLE)
+				kind = PM_PGTABLE;
+			else
+				kind = PM_ALLOC;
+		}
+		if (freeleft > 0)
+			freeleft--;
+
+		if (kind == runkind)
+			continue;
+		if (runkind >= 0) {
+			count[runkind] += i - start;
+			if (runkind == PM_FREE && i - start > maxfree) {
+				maxfree = i - start;
+				maxfree_start = start;
+			}
+			if (nruns < maxruns)
+				cprintf("  %08x-%08x %7u  %s\n", start << PGSHIFT,
+					(i << PGSHIFT) - 1, i - start,
+					pm_kind_names[runkind]);
+			nruns++;
+		}
+		runkind = kind;
+		start = i;
+	}
+	if (nruns > maxruns)
+		cprintf("  ... %d more runs\n", nruns - maxruns);
+
+	for (kind = 0; kind < PM_NKIND; kind++)
+		cprintf("%s: %u pages%s", pm_kind_names[kind], count[kind],
+			kind == PM_NKIND - 1 ? "\n" : ", ");
+	if (maxfree)
+		cprintf("largest free run: %u pages (%uKB) at %08x\n",
+			maxfree, maxfree * (PGSIZE / 1024),
+			maxfree_start << PGSHIFT);
+	else
+		cprintf("largest free run: none\n");
+}
+
+//
+// Zero the memory-management counters, e.g. between benchmark runs.
+//
+void
+pmap_reset_stats(void)
+{
+	memset(pmap_stats, 0, sizeof(pmap_stats));
+}
+
+//
+// Temporarily take every free block away from the allocator, saving
+// the free lists in fl[PAGE_NORDER], so that the checks below can run
+// against an empty pool.  The stolen blocks lose PP_FREE, so nothing
+// freed in the meantime coalesces with them.
+//
+static void
+page_free_steal(struct Page_list *fl)
+{
+	struct Page *pp;
+	int o;
+
+	page_mag_drain();
+	spin_lock(&page_lock);
+	page_zero_drain();
+	pgtable_quick_drain();
+	page_color_drain();
+	for (o = 0; o < PAGE_NORDER; o++) {
+		PAGE_LIST_FOREACH(pp, &page_free_area[o])
+			pp->pp_flags = 0;
+		fl[o] = page_free_area[o];
+		page_list_init(&page_free_area[o]);
+	}
+	spin_unlock(&page_lock);
+}
+
+//
+// Give back the free lists taken by page_free_steal().
+// The allocator's own free lists must be empty at this point.
+//
+static void
+page_free_return(struct Page_list *fl)
+{
+	struct Page *pp;
+	int o;
+
+	spin_lock(&page_lock);
+	for (o = 0; o < PAGE_NORDER; o++) {
+		assert(page_list_empty(&page_free_area[o]));
+		page_free_area[o] = fl[o];
+		PAGE_LIST_FOREACH(pp, &page_free_area[o])
+			pp->pp_flags = PP_FREE;
+	}
+	spin_unlock(&page_lock);
+}
+
+//
+// Decrement the reference count on a page,
+// freeing it if there are no more refs.
+// The decrement is atomic, so CPUs sharing the page can race here.
+//
+void
+page_decref(struct Page* pp)
+{
+	uint32_t old;
+
+	if (pp == zero_page)
+		return;
+#ifdef PAGE_REF_DEBUG
+	if (pp->pp_flags & (PP_FREE | PP_CACHED | PP_ZERO))
+		panic("page_decref: page %08x is free", page2pa(pp));
+#endif
+	// Only the CPU that drops the last reference frees the page.
+	old = xadd(&pp->pp_ref, -1);
+	if (old == 1)
+		page_free(pp);
+#ifdef PAGE_REF_DEBUG
+	else if (old == 0)
+		panic("page_decref: page %08x reference count underflow",
+		      page2pa(pp));
+#endif
+}
+
+//
+// page_decref() for the first page of a 4MB user page, which goes
+// back to the buddy lists as one block when its last mapping goes.
+//
+static void
+page_decref_large(struct Page *pp)
+{
+	uint32_t old;
+
+	old = xadd(&pp->pp_ref, -1);
+	if (old == 1) {
+		page_large_mark(pp, 0);
+		page_free_order(pp, PAGE_LARGE_ORDER);
+	}
+#ifdef PAGE_REF_DEBUG
+	else if (old == 0)
+		panic("page_decref_large: page %08x reference count underflow",
+		      page2pa(pp));
+#endif
+}
+
+//
+// Set pp_order to 'order' in every page of the 4MB block headed by
+// 'pp': PAGE_LARGE_ORDER while it is mapped as a 4MB page, so that
+// page_insert() refuses to map its pages one by one (their pp_ref
+// counts nothing), and 0 again when it is freed.
+//
+static void
+page_large_mark(struct Page *pp, int order)
+{
+	uint32_t i;
+
+	for (i = 0; i < (1 << PAGE_LARGE_ORDER); i++)
+		pp[i].pp_order = order;
+}
+
+//
+// The lock that guards the page tables of 'pgdir'.
+//
+static struct Spinlock *
+pgdir_spinlock(pde_t *pgdir)
+{
+	return &pgdir_locks[((uintptr_t) pgdir >> PGSHIFT) % PGDIR_NLOCK];
+}
+
+void
+pgdir_lock(pde_t *pgdir)
+{
+	spin_lock(pgdir_spinlock(pgdir));
+}
+
+void
+pgdir_unlock(pde_t *pgdir)
+{
+	spin_unlock(pgdir_spinlock(pgdir));
+}
+
+//
+// Lock two page directories, which may share a lock, in address order.
+//
+static void
+pgdir_lock_two(pde_t *a, pde_t *b)
+{
+	struct Spinlock *la = pgdir_spinlock(a), *lb = pgdir_spinlock(b);
+
+	if (la == lb)
+		spin_lock(la);
+	else if (la < lb) {
+		spin_lock(la);
+		spin_lock(lb);
+	} else {
+		spin_lock(lb);
+		spin_lock(la);
+	}
+}
+
+static void
+pgdir_unlock_two(pde_t *a, pde_t *b)
+{
+	struct Spinlock *la = pgdir_spinlock(a), *lb = pgdir_spinlock(b);
+
+	spin_unlock(la);
+	if (la != lb)
+		spin_unlock(lb);
+}
+
+// Given 'pgdir', a pointer to a page directory, pgdir_walk returns
+// a pointer to the page table entry (PTE) for linear address 'va'.
+// This requires walking the two-level page table structure.
+//
+// If the relevant page table doesn't exist in the page directory, then:
+//    - If create == 0, pgdir_walk returns NULL.
+//    - Otherwise, pgdir_walk tries to allocate a new page table
+//	with page_alloc.  If this fails, pgdir_walk returns NULL.
+//    - pgdir_walk sets pp_ref to 1 for the new page table.
+//    - pgdir_walk clears the new page table.
+//    - Finally, pgdir_walk returns a pointer into the new page table.
+//
+// Hint: you can turn a Page * into the physical address of the
+// page it refers to with page2pa() from kern/pmap.h.
+//
+// Hint 2: the x86 MMU checks permission bits in both the page directory
+// and the page table, so it's safe to leave permissions in the page
+// more permissive than strictly necessary.
+//
+// If 'va' lies in a 4MB page (PTE_PS set in the PDE), there is no page
+// table, and pgdir_walk returns a pointer to the PDE itself.
+//
+// pgdir_walk takes pgdir's lock only for the walk itself.  Callers that
+// go on to read or change the PTE should hold the lock across both,
+// with pgdir_lock() and pgdir_walk_locked().
+pte_t *
+pgdir_walk(pde_t *pgdir, const void *va, int create)
+{
+	pte_t *pte;
+
+	pgdir_lock(pgdir);
+	pte = pgdir_walk_locked(pgdir, va, create);
+	pgdir_unlock(pgdir);
+	return pte;
+}
+
+pte_t *
+pgdir_walk_locked(pde_t *pgdir, const void *va, int create)
+{
+	pde_t *pde;
+	struct Page *pp;
+
+	PMAP_STAT(ps_pgdir_walk);
+	if (pgdir == cur_pgdirs[cpunum()])
+		return pgdir_walk_current(va, create);
+	pde = &pgdir[PDX(va)];
+	if (*pde & PTE_PS)
+		return pde;
+	if (!(*pde & PTE_P)) {
+		// The quicklist hands out page tables that are already clear.
+		if (!create || pgtable_alloc(&pp) < 0)
+			return NULL;
+		PMAP_STAT(ps_pgtable_new);
+		pp->pp_ref = 1;
+		*pde = page2pa(pp) | PTE_U | PTE_W | PTE_P;
+	}
+	return (pte_t *) KADDR(PTE_ADDR(*pde)) + PTX(va);
+}
+
+//
+// pgdir_walk_locked() for the page directory loaded on this CPU.  Its
+// page tables appear at vpt[] through the VPT self-mapping, so the PTE
+// for 'va' is simply vpt[VPN(va)]: no KADDR() translation and no
+// bounds check on the page table's address.  The returned pointer is
+// only good while the page directory stays loaded.
+//
+static pte_t *
+pgdir_walk_current(const void *va, int create)
+{
+	pde_t *pde;
+	struct Page *pp;
+
+	pde = (pde_t *) &vpd[PDX(va)];
+	if (*pde & PTE_PS)
+		return pde;
+	if (!(*pde & PTE_P)) {
+		if (!create || pgtable_alloc(&pp) < 0)
+			return NULL;
+		PMAP_STAT(ps_pgtable_new);
+		pp->pp_ref = 1;
+		*pde = page2pa(pp) | PTE_U | PTE_W | PTE_P;
+		// The page table's window in vpt[] may still be cached
+		// for a page table that was freed.
+		invlpg((void *) &vpt[VPN(va) & ~(NPTENTRIES - 1)]);
+	}
+	return (pte_t *) &vpt[VPN(va)];
+}
+
+//
+// Load 'pgdir' into CR3 on this CPU.
+//
+void
+pgdir_load(pde_t *pgdir)
+{
+	lcr3(PADDR(pgdir));
+	cur_pgdirs[cpunum()] = pgdir;
+}
+
+//
+// Check the permissions a system call asks for on a user mapping:
+// PTE_U and PTE_P must be set, and nothing outside PTE_SYSCALL.
+// In particular, a user process can't set PTE_COW and have the kernel
+// copy pages on its behalf.
+//
+// RETURNS: 0 if 'perm' is allowed, -E_INVAL otherwise
+//
+int
+page_check_perm(int perm)
+{
+	if ((perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P)
+	    || (perm & ~PTE_SYSCALL))
+		return -E_INVAL;
+	return 0;
+}
+
+//
+// Map the physical page 'pp' at virtual address 'va'.
+// The permissions (the low 12 bits) of the page table
+//  entry should be set to 'perm|PTE_P'.
+//
+// Requirements
+//   - If there is already a page mapped at 'va', it should be page_remove()d.
+//   - If necessary, on demand, a page table should be allocated and inserted
+//     into 'pgdir'.
+//   - pp->pp_ref should be incremented if the insertion succeeds.
+//   - The TLB must be invalidated if a page was formerly present at 'va'.
+//
+// Corner-case hint: Make sure to consider what happens when the same 
+// pp is re-inserted at the same virtual address in the same pgdir.
+//
+// If 'perm' includes PTE_PS, 'pp' must head a block of 2^PAGE_LARGE_ORDER
+// pages from page_alloc_order(), and the whole block is mapped as one
+// 4MB page at the PTSIZE-aligned user address 'va': a single page
+// directory entry, a single reference (on 'pp') and a single TLB entry
+// instead of 1024 of each.  Whatever was mapped in that 4MB is
+// unmapped first, and its page table freed.
+//
+// RETURNS: 
+//   0 on success
+//   -E_NO_MEM, if page table couldn't be allocated
+//   -E_INVAL, if 'va' lies in a 4MB page or 'pp' in a 4MB page's block
+//	(and PTE_PS is not set), or for PTE_PS, if 'va' or 'pp' is not
+//	4MB-aligned, 'va' is not below UTOP, some page of the block is
+//	free or in use on its own, or the CPU has no 4MB pages
+//
+// Hint: The TA solution is implemented using pgdir_walk, page_remove,
+// and page2pa.
+//
+int
+page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm) 
+{
+	int r;
+
+	pgdir_lock(pgdir);
+	r = page_insert_locked(pgdir, pp, va, perm);
+	pgdir_unlock(pgdir);
+	return r;
+}
+
+static int
+page_insert_locked(pde_t *pgdir, struct Page *pp, void *va, int perm)
+{
+	pte_t *pte;
+
+	PMAP_STAT(ps_page_insert);
+	if (perm & PTE_PS)
+		return page_insert_large_locked(pgdir, pp, va, perm);
+	// A 4MB page can't have a 4KB page mapped inside it, and the
+	// pages of a 4MB page can't be mapped as 4KB pages.
+	if ((pgdir[PDX(va)] & PTE_PS) || pp->pp_order == PAGE_LARGE_ORDER)
+		return -E_INVAL;
+	if ((pte = pgdir_walk_locked(pgdir, va, 1)) == NULL)
+		return -E_NO_MEM;
+
+	// Take the new reference first, so that re-inserting the same
+	// page at the same address doesn't free it.
+	page_ref_inc(pp);
+	if (*pte & PTE_P)
+		page_remove_locked(pgdir, va);
+	*pte = page2pa(pp) | perm | PTE_P;
+	return 0;
+}
+
+//
+// page_insert_locked() for a 4MB page (PTE_PS in 'perm').
+//
+static int
+page_insert_large_locked(pde_t *pgdir, struct Page *pp, void *va, int perm)
+{
+	uint32_t i;
+
+	if (!pse_enabled || (uintptr_t) va % PTSIZE
+	    || (uintptr_t) va >= UTOP || page2pa(pp) % PTSIZE
+	    || page2ppn(pp) + (1 << PAGE_LARGE_ORDER) > npage)
+		return -E_INVAL;
+
+	// page_large_mark() rewrites the Page struct of every page in the
+	// block, so the block must be what page_alloc_order() hands out:
+	// allocated, unreferenced and not part of another 4MB page.
+	if (pp->pp_order != PAGE_LARGE_ORDER) {
+		for (i = 0; i < (1 << PAGE_LARGE_ORDER); i++)
+			if (pp[i].pp_flags || pp[i].pp_ref || pp[i].pp_order)
+				return -E_INVAL;
+		page_large_mark(pp, PAGE_LARGE_ORDER);
+	}
+	page_ref_inc(pp);
+	pgdir_clear_pde_locked(pgdir, va);
+	pgdir[PDX(va)] = page2pa(pp) | perm | PTE_P;
+	return 0;
+}
+
+//
+// Unmap everything that the page directory entry for 'va' maps,
+// whether a 4MB page or a page table, and free the page table.  As in
+// page_remove_range, the pages (and the table itself) are only freed
+// once their TLB entries are gone.
+//
+static void
+pgdir_clear_pde_locked(pde_t *pgdir, void *va)
+{
+	struct TlbGather tg;
+	struct Page *pt;
+	pde_t *pde;
+	pte_t *pte;
+	uint32_t j;
+
+	va = ROUNDDOWN(va, PTSIZE);
+	pde = &pgdir[PDX(va)];
+	if (!(*pde & PTE_P))
+		return;
+	if (*pde & PTE_PS) {
+		page_remove_locked(pgdir, va);
+		return;
+	}
+	pte = pgdir_walk_locked(pgdir, va, 0);
+	tlb_gather_init(&tg, pgdir);
+	for (j = 0; j < NPTENTRIES; j++) {
+		if (!(pte[j] & PTE_P))
+			continue;
+		tlb_gather_add(&tg, (char *) va + j * PGSIZE,
+			       PPN(pte[j]) < npage ?
+			       pa2page(PTE_ADDR(pte[j])) : NULL);
+		pte[j] = 0;
+	}
+	pt = pa2page(PTE_ADDR(*pde));
+	*pde = 0;
+	// Also drops any cached copy of the old directory entry, even if
+	// the table had no mappings left.
+	tlb_invalidate(pgdir, va);
+	tlb_gather_flush(&tg);
+	pgtable_free(pt);
+}
+
+//
+// Map [la, la+size) of linear address space to physical [pa, pa+size)
+// in the page table rooted at pgdir.  Size is a multiple of PGSIZE.
+// Use permission bits perm|PTE_P for the entries.
+//
+// This function is only intended to set up the ``static'' mappings
+// above UTOP. As such, it should *not* change the pp_ref field on the
+// mapped pages.
+//
+// Hint: the TA solution uses pgdir_walk
+//
+// When PSE is available, each PTSIZE-aligned 4MB chunk of the segment
+// is mapped by a single PTE_PS directory entry instead of a page table.
+// Otherwise each page table is walked to once and then filled in a
+// tight loop (see boot_map_pages()).
+static void
+boot_map_segment(pde_t *pgdir, uintptr_t la, size_t size, physaddr_t pa, int perm)
+{
+	size_t off, n;
+
+	assert(size % PGSIZE == 0);
+	for (off = 0; off < size; ) {
+		if (pse_enabled && (la + off) % PTSIZE == 0
+		    && (pa + off) % PTSIZE == 0 && size - off >= PTSIZE) {
+			assert(!(pgdir[PDX(la + off)] & PTE_P));
+			pgdir[PDX(la + off)] = (pa + off) | perm | PTE_PS | PTE_P;
+			boot_nlarge++;
+			off += PTSIZE;
+			continue;
+		}
+		n = MIN(NPTENTRIES - PTX(la + off), (size - off) / PGSIZE);
+		boot_map_pages(pgdir, la + off, n, pa + off, perm);
+		off += n * PGSIZE;
+	}
+}
+
+//
+// Map 'n' 4KB pages at 'la', which all fall in one page table, to
+// physical address 'pa', with one pgdir_walk() for the lot.
+//
+static void
+boot_map_pages(pde_t *pgdir, uintptr_t la, size_t n, physaddr_t pa, int perm)
+{
+	pte_t *pte;
+	size_t i;
+
+	if ((pte = pgdir_walk(pgdir, (void *) la, 1)) == NULL)
+		panic("boot_map_segment: out of memory");
+	for (i = 0; i < n; i++)
+		pte[i] = (pa + i * PGSIZE) | perm | PTE_P;
+}
+
+//
+// Clear and free the page tables that map [KERNBASE, 2^32) in the
+// scratch page directory of boot_map_bench().
+//
+static void
+boot_map_bench_clear(pde_t *pgdir)
+{
+	uint32_t pdx;
+
+	for (pdx = PDX(KERNBASE); pdx < NPDENTRIES; pdx++) {
+		if (!(pgdir[pdx] & PTE_P))
+			continue;
+		memset(KADDR(PTE_ADDR(pgdir[pdx])), 0, PGSIZE);
+		pgtable_free(pa2page(PTE_ADDR(pgdir[pdx])));
+		pgdir[pdx] = 0;
+	}
+}
+
+//
+// Show what batching boot_map_segment() saves where it can't use 4MB
+// pages: map [KERNBASE, 2^32) with 4KB pages into a scratch page
+// directory, once with one pgdir_walk() per page table, as
+// boot_map_segment() does, and once with one pgdir_walk() per page,
+// and print the cycles each took next to what the boot mapping took.
+// A first, untimed run leaves the page table quicklist in the same
+// state for both.
+//
+void
+boot_map_bench(void)
+{
+	static const char *const names[3] = {
+		NULL, "one walk per page table", "one walk per page"
+	};
+	struct Page *pd;
+	pde_t *pgdir;
+	uintptr_t la;
+	uint64_t tsc;
+	size_t buddy, cached;
+	int run;
+
+	// The page tables, plus some slack for the quicklist.
+	if (page_nfree(&buddy, &cached) < 2 * PDX(-KERNBASE)
+	    || page_alloc_zeroed(&pd) < 0) {
+		cprintf("boot_map_bench: out of memory\n");
+		return;
+	}
+	pgdir = page2kva(pd);
+	cprintf("KERNBASE at boot: %u cycles, with %u 4MB pages\n",
+		boot_map_cycles, boot_nlarge);
+	for (run = 0; run < 3; run++) {
+		tsc = read_tsc();
+		if (run < 2)
+			for (la = KERNBASE; la != 0; la += PTSIZE)
+				boot_map_pages(pgdir, la, NPTENTRIES,
+					       la - KERNBASE, PTE_W);
+		else
+			for (la = KERNBASE; la != 0; la += PGSIZE)
+				boot_map_pages(pgdir, la, 1, la - KERNBASE,
+					       PTE_W);
+		tsc = read_tsc() - tsc;
+		if (run > 0)
+			cprintf("4KB pages, %-24s %u cycles\n", names[run],
+				(uint32_t) tsc);
+		boot_map_bench_clear(pgdir);
+	}
+	page_free(pd);
+}
+
+//
+// Return the page mapped at virtual address 'va'.
+// If pte_store is not zero, then we store in it the address
+// of the pte for this page.  This is used by page_remove
+// but should not be used by other callers.
+//
+// Return NULL if there is no page mapped at va.
+//
+// In a 4MB page, this is the 4KB page that 'va' falls in, and the
+// pte is the page directory entry.  A 4MB user page's reference count
+// is kept on its first page, so it can only be mapped elsewhere whole,
+// with page_insert() and PTE_PS; page_insert() refuses its pages as
+// 4KB pages.
+//
+// Hint: the TA solution uses pgdir_walk and pa2page.
+//
+struct Page *
+page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
+{
+	struct Page *pp;
+
+	pgdir_lock(pgdir);
+	pp = page_lookup_locked(pgdir, va, pte_store);
+	pgdir_unlock(pgdir);
+	return pp;
+}
+
+static struct Page *
+page_lookup_locked(pde_t *pgdir, void *va, pte_t **pte_store)
+{
+	pte_t *pte;
+	physaddr_t pa;
+
+	pte = pgdir_walk_locked(pgdir, va, 0);
+	if (pte == NULL || !(*pte & PTE_P))
+		return NULL;
+	if (pgdir[PDX(va)] & PTE_PS)
+		pa = PDE_LARGE_ADDR(*pte) + (PTX(va) << PTXSHIFT);
+	else
+		pa = PTE_ADDR(*pte);
+	// The KERNBASE mapping extends past the end of physical memory.
+	if (PPN(pa) >= npage)
+		return NULL;
+	if (pte_store)
+		*pte_store = pte;
+	return pa2page(pa);
+}
+
+//
+// Unmaps the physical page at virtual address 'va'.
+// If there is no physical page at that address, silently does nothing.
+//
+// Details:
+//   - The ref count on the physical page should decrement.
+//   - The physical page should be freed if the refcount reaches 0.
+//   - The pg table entry corresponding to 'va' should be set to 0.
+//     (if such a PTE exists)
+//   - The TLB must be invalidated if you remove an entry from
+//     the pg dir/pg table.
+//
+// If 'va' lies in a 4MB user page, the whole 4MB page is unmapped.
+//
+// Hint: The TA solution is implemented using page_lookup,
+// 	tlb_invalidate, and page_decref.
+//
+void
+page_remove(pde_t *pgdir, void *va)
+{
+	pgdir_lock(pgdir);
+	page_remove_locked(pgdir, va);
+	pgdir_unlock(pgdir);
+}
+
+static void
+page_remove_locked(pde_t *pgdir, void *va)
+{
+	struct Page *pp;
+	pte_t *pte;
+
+	PMAP_STAT(ps_page_remove);
+	if ((pp = page_lookup_locked(pgdir, va, &pte)) == NULL)
+		return;
+	if (pgdir[PDX(va)] & PTE_PS) {
+		if ((uintptr_t) va >= UTOP)
+			panic("page_remove: %08x lies in a kernel 4MB page",
+			      va);
+		pp = pa2page(PDE_LARGE_ADDR(*pte));
+		*pte = 0;
+		tlb_invalidate(pgdir, va);
+		page_decref_large(pp);
+		return;
+	}
+	page_decref(pp);
+	*pte = 0;
+	tlb_invalidate(pgdir, va);
+}
+
+//
+// Invalidate a TLB entry, but only if the page tables being
+// edited are the ones currently in use by the processor.
+// Other CPUs are not told (see the locking comment above).
+//
+void
+tlb_invalidate(pde_t *pgdir, void *va)
+{
+	// Flush the entry only if we're modifying the current address space.
+	// Every page directory maps the kernel half above UTOP through the
+	// same page tables (see pgdir_create()), so flush those always.
+	// invlpg drops the entry even if it is global (PTE_G).
+	if (pgdir != cur_pgdirs[cpunum()] && (uintptr_t) va < UTOP)
+		return;
+	PMAP_STAT(ps_tlb_invalidate);
+	invlpg(va);
+}
+
+//
+// Like page_remove, but leaves the TLB invalidation and the release
+// of the page's reference to the gather 'tg'.
+//
+void
+page_remove_gather(struct TlbGather *tg, void *va)
+{
+	struct Page *pp;
+	pte_t *pte;
+
+	pgdir_lock(tg->tg_pgdir);
+	if ((pp = page_lookup_locked(tg->tg_pgdir, va, &pte)) == NULL) {
+		pgdir_unlock(tg->tg_pgdir);
+		return;
+	}
+	if (tg->tg_pgdir[PDX(va)] & PTE_PS) {
+		// A 4MB page has no 4KB page to hand to the gather.
+		page_remove_locked(tg->tg_pgdir, va);
+		pgdir_unlock(tg->tg_pgdir);
+		return;
+	}
+	*pte = 0;
+	pgdir_unlock(tg->tg_pgdir);
+	tlb_gather_add(tg, va, pp);
+}
+
+//
+// Map the 'n' pages pps[0..n-1] at consecutive pages starting at 'va',
+// with permissions 'perm|PTE_P'.  Like n calls to page_insert(), but
+// each page table is looked up once, and the TLB entries of replaced
+// mappings are invalidated together at the end.
+//
+// Either all of the pages get mapped or none are: the page tables the
+// range needs are allocated before any entry changes.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page table couldn't be allocated
+//   -E_INVAL, if va is not page-aligned, the range overlaps a 4MB page,
+//	or one of the pages belongs to a 4MB page
+//
+int
+page_insert_range(pde_t *pgdir, struct Page **pps, size_t n, void *va,
+		  int perm)
+{
+	struct TlbGather tg;
+	uintptr_t la;
+	pte_t *pte;
+	size_t i, j, m;
+
+	if ((uintptr_t) va % PGSIZE)
+		return -E_INVAL;
+	// As in page_insert, the pages of a 4MB page only map whole.
+	for (i = 0; i < n; i++)
+		if (pps[i]->pp_order == PAGE_LARGE_ORDER)
+			return -E_INVAL;
+	pgdir_lock(pgdir);
+	for (la = (uintptr_t) va, i = 0; i < n; la += m * PGSIZE, i += m) {
+		m = MIN(NPTENTRIES - PTX(la), n - i);
+		if (pgdir[PDX(la)] & PTE_PS) {
+			pgdir_unlock(pgdir);
+			return -E_INVAL;
+		}
+		if (pgdir_walk_locked(pgdir, (void *) la, 1) == NULL) {
+			pgdir_unlock(pgdir);
+			return -E_NO_MEM;
+		}
+	}
+
+	tlb_gather_init(&tg, pgdir);
+	for (la = (uintptr_t) va, i = 0; i < n; la += m * PGSIZE, i += m) {
+		m = MIN(NPTENTRIES - PTX(la), n - i);
+		pte = pgdir_walk_locked(pgdir, (void *) la, 0);
+		for (j = 0; j < m; j++) {
+			// As in page_insert, count the new reference before
+			// the old one can go.
+			page_ref_inc(pps[i + j]);
+			if (pte[j] & PTE_P)
+				tlb_gather_add(&tg, (void *) (la + j * PGSIZE),
+					       PPN(pte[j]) < npage ?
+					       pa2page(PTE_ADDR(pte[j])) : NULL);
+			pte[j] = page2pa(pps[i + j]) | perm | PTE_P;
+		}
+	}
+	tlb_gather_flush(&tg);
+	pgdir_unlock(pgdir);
+	return 0;
+}
+
+//
+// Unmap every page in [va, va+size).  Like calling page_remove() on
+// each page, but each page table is looked up once, ranges without a
+// page table are skipped whole, and the TLB is invalidated in batches.
+// The page tables themselves stay in place.  A 4MB user page that
+// overlaps the range is unmapped whole.
+//
+void
+page_remove_range(pde_t *pgdir, void *va, size_t size)
+{
+	struct TlbGather tg;
+	uintptr_t la, end;
+	pte_t *pte;
+	size_t j, m;
+
+	la = ROUNDDOWN((uintptr_t) va, PGSIZE);
+	end = ROUNDUP((uintptr_t) va + size, PGSIZE);
+	pgdir_lock(pgdir);
+	tlb_gather_init(&tg, pgdir);
+	for (; la != end; la += m * PGSIZE) {
+		m = MIN(NPTENTRIES - PTX(la), (end - la) / PGSIZE);
+		if (!(pgdir[PDX(la)] & PTE_P))
+			continue;
+		if (pgdir[PDX(la)] & PTE_PS) {
+			page_remove_locked(pgdir, (void *) la);
+			continue;
+		}
+		pte = pgdir_walk_locked(pgdir, (void *) la, 0);
+		for (j = 0; j < m; j++) {
+			if (!(pte[j] & PTE_P))
+				continue;
+			tlb_gather_add(&tg, (void *) (la + j * PGSIZE),
+				       PPN(pte[j]) < npage ?
+				       pa2page(PTE_ADDR(pte[j])) : NULL);
+			pte[j] = 0;
+		}
+	}
+	tlb_gather_flush(&tg);
+	pgdir_unlock(pgdir);
+}
+
+//
+// Duplicate the user mappings in [va, va+size) from 'src' into 'dst',
+// sharing the pages instead of copying them.  Writable pages become
+// read-only and copy-on-write (PTE_COW) in both page directories, and
+// the first write to one of them is resolved by page_fault_cow().
+// Read-only pages are simply shared.  Either way each shared page
+// gains a reference, so the cost scales with the number of mapped
+// pages, not with their contents.
+//
+// A 4MB page is shared the same way, through its page directory entry,
+// and gains one reference on its first page.
+//
+// Anything already mapped in 'dst' in the range is replaced; a 4MB page
+// there is unmapped whole.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page table couldn't be allocated; the part of the
+//	range duplicated so far stays in 'dst'
+//   -E_INVAL, if the range is not below UTOP or covers only part of a
+//	4MB page in 'src'
+//
+int
+pgdir_copy_cow(pde_t *dst, pde_t *src, void *va, size_t size)
+{
+	uintptr_t la, end;
+	pte_t *spte, *dpte;
+	size_t j, m;
+	int r, wp;
+
+	la = ROUNDDOWN((uintptr_t) va, PGSIZE);
+	end = ROUNDUP((uintptr_t) va + size, PGSIZE);
+	if (end > UTOP || end < la)
+		return -E_INVAL;
+
+	pgdir_lock_two(dst, src);
+	r = wp = 0;
+	for (; la != end; la += m * PGSIZE) {
+		m = MIN(NPTENTRIES - PTX(la), (end - la) / PGSIZE);
+		if (!(src[PDX(la)] & PTE_P))
+			continue;
+		if (src[PDX(la)] & PTE_PS) {
+			// Share the whole 4MB page through the directory entry.
+			if (m != NPTENTRIES) {
+				r = -E_INVAL;
+				break;
+			}
+			if (src[PDX(la)] & PTE_W) {
+				src[PDX(la)] = (src[PDX(la)] & ~PTE_W) | PTE_COW;
+				wp = 1;
+			}
+			page_ref_inc(pa2page(PDE_LARGE_ADDR(src[PDX(la)])));
+			pgdir_clear_pde_locked(dst, (void *) la);
+			dst[PDX(la)] = src[PDX(la)];
+			continue;
+		}
+		// A 4MB page in 'dst' goes whole, as page_remove would do it.
+		if (dst[PDX(la)] & PTE_PS)
+			pgdir_clear_pde_locked(dst, (void *) la);
+		spte = pgdir_walk_locked(src, (void *) la, 0);
+		if ((dpte = pgdir_walk_locked(dst, (void *) la, 1)) == NULL) {
+			r = -E_NO_MEM;
+			break;
+		}
+		for (j = 0; j < m; j++) {
+			if (!(spte[j] & PTE_P))
+				continue;
+			if (spte[j] & PTE_W) {
+				spte[j] = (spte[j] & ~PTE_W) | PTE_COW;
+				wp = 1;
+			}
+			if (PPN(spte[j]) < npage)
+				page_ref_inc(pa2page(PTE_ADDR(spte[j])));
+			if (dpte[j] & PTE_P)
+				page_remove_locked(dst,
+						   (void *) (la + j * PGSIZE));
+			dpte[j] = spte[j];
+		}
+	}
+
+	// The pages that were writable in 'src' are read-only now.
+	if (wp)
+		tlb_invalidate_range(src, va, size);
+	pgdir_unlock_two(dst, src);
+	return r;
+}
+
+//
+// Handle a page fault at 'va' with error code 'err' if it is a write
+// to a copy-on-write page.  The trap handler should try this before
+// treating a T_PGFLT as fatal.
+//
+// A page with other sharers is copied into a fresh page, which replaces
+// it at 'va'.  The last sharer just gets write access back, with no copy.
+// A demand-zero page (see page_map_zero) gets a cleared page instead.
+// A shared 4MB page is copied whole.
+//
+// RETURNS:
+//   0 if the fault was resolved and the instruction can be restarted
+//   -E_FAULT, if this is not a write to a copy-on-write page
+//   -E_NO_MEM, if there was no page to copy into
+//
+int
+page_fault_cow(pde_t *pgdir, void *va, uint32_t err)
+{
+	struct Page *pp, *npp;
+	pte_t *pte;
+	int perm, r;
+
+	if ((err & (FEC_PR | FEC_WR)) != (FEC_PR | FEC_WR))
+		return -E_FAULT;
+	pgdir_lock(pgdir);
+	if ((pp = page_lookup_locked(pgdir, va, &pte)) == NULL
+	    || !(*pte & PTE_COW)) {
+		r = -E_FAULT;
+		goto out;
+	}
+
+	perm = (*pte & (PTE_AVAIL | PTE_U | PTE_PWT | PTE_PCD) & ~PTE_COW)
+		| PTE_W;
+	if (pgdir[PDX(va)] & PTE_PS) {
+		r = page_fault_cow_large(pgdir, va, perm | PTE_PS);
+		goto out;
+	}
+	va = ROUNDDOWN(va, PGSIZE);
+	if (pp == zero_page) {
+		if ((r = page_alloc_zeroed(&npp)) < 0)
+			goto out;
+	} else if (pp->pp_ref == 1) {
+		// Other address spaces only take references to pp under
+		// their own locks, from mappings they already share, so
+		// the count cannot grow while we hold the last one.
+		*pte = PTE_ADDR(*pte) | perm | PTE_P;
+		tlb_invalidate(pgdir, va);
+		r = 0;
+		goto out;
+	} else {
+		if ((r = page_alloc(&npp)) < 0)
+			goto out;
+		memmove(page2kva(npp), page2kva(pp), PGSIZE);
+	}
+	// Replacing the mapping drops our reference to the shared page.
+	r = page_insert_locked(pgdir, npp, va, perm);
+	assert(r == 0);
+out:
+	pgdir_unlock(pgdir);
+	return r;
+}
+
+//
+// page_fault_cow for the 4MB page mapped at 'va', which is to get
+// permissions 'perm'.
+//
+static int
+page_fault_cow_large(pde_t *pgdir, void *va, int perm)
+{
+	struct Page *pp, *npp;
+	pde_t *pde;
+	int r;
+
+	va = ROUNDDOWN(va, PTSIZE);
+	pde = &pgdir[PDX(va)];
+	pp = pa2page(PDE_LARGE_ADDR(*pde));
+	if (pp->pp_ref == 1) {
+		*pde = PDE_LARGE_ADDR(*pde) | perm | PTE_P;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+	if ((r = page_alloc_order(PAGE_LARGE_ORDER, &npp)) < 0)
+		return r;
+	memmove(page2kva(npp), page2kva(pp), PTSIZE);
+	r = page_insert_large_locked(pgdir, npp, va, perm);
+	assert(r == 0);
+	return 0;
+}
+
+//
+// Reserve [va, va+size) as demand-zero memory with permissions 'perm'.
+// Every page in the range maps the shared zero page read-only, so
+// reading it allocates nothing.  If 'perm' includes PTE_W, the pages
+// are marked PTE_COW instead, and the first write to each one gets it
+// a page of its own through page_fault_cow().  Memory use thus follows
+// the pages actually written, not the size of the region.
+//
+// Anything mapped in the range before is unmapped.  As with
+// page_insert_range, the range is either reserved whole or not at all.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page table couldn't be allocated
+//   -E_INVAL, if the range is not below UTOP or overlaps a 4MB page
+//
+int
+page_map_zero(pde_t *pgdir, void *va, size_t size, int perm)
+{
+	struct TlbGather tg;
+	uintptr_t la, start, end;
+	pte_t *pte;
+	size_t j, m;
+
+	start = ROUNDDOWN((uintptr_t) va, PGSIZE);
+	end = ROUNDUP((uintptr_t) va + size, PGSIZE);
+	if (end > UTOP || end < start)
+		return -E_INVAL;
+	pgdir_lock(pgdir);
+	for (la = start; la != end; la += m * PGSIZE) {
+		m = MIN(NPTENTRIES - PTX(la), (end - la) / PGSIZE);
+		if (pgdir[PDX(la)] & PTE_PS) {
+			pgdir_unlock(pgdir);
+			return -E_INVAL;
+		}
+		if (pgdir_walk_locked(pgdir, (void *) la, 1) == NULL) {
+			pgdir_unlock(pgdir);
+			return -E_NO_MEM;
+		}
+	}
+
+	if (perm & PTE_W)
+		perm = (perm & ~PTE_W) | PTE_COW;
+	tlb_gather_init(&tg, pgdir);
+	for (la = start; la != end; la += m * PGSIZE) {
+		m = MIN(NPTENTRIES - PTX(la), (end - la) / PGSIZE);
+		pte = pgdir_walk_locked(pgdir, (void *) la, 0);
+		for (j = 0; j < m; j++) {
+			if (pte[j] & PTE_P)
+				tlb_gather_add(&tg, (void *) (la + j * PGSIZE),
+					       PPN(pte[j]) < npage ?
+					       pa2page(PTE_ADDR(pte[j])) : NULL);
+			pte[j] = page2pa(zero_page) | perm | PTE_P;
+		}
+	}
+	tlb_gather_flush(&tg);
+	pgdir_unlock(pgdir);
+	return 0;
+}
+
+//
+// Create a page directory for a new address space.  The user half
+// (below UTOP) starts out empty, and the kernel half is copied from
+// boot_pgdir, which is the template for every address space: the
+// kernel's page tables and 4MB pages are shared, so a new page
+// directory costs one (usually pre-zeroed) page and a copy of the
+// NPDENTRIES - PDX(UTOP) kernel entries.  Only the VPT and UVPT
+// self-mappings are changed to point at the new directory.
+//
+// Kernel mappings made in boot_pgdir later on show up in every address
+// space at once if they go into an existing kernel page table.  A new
+// kernel page directory entry reaches older page directories lazily,
+// through pgdir_kern_fault().
+//
+// On success *pgdir_store is set to the new page directory, whose page
+// has a pp_ref of 1.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if there was no page for the directory
+//
+int
+pgdir_create(pde_t **pgdir_store)
+{
+	struct Page *pp;
+	pde_t *pgdir;
+	int r;
+
+	if ((r = page_alloc_zeroed(&pp)) < 0)
+		return r;
+	pp->pp_ref = 1;
+	pgdir = page2kva(pp);
+	memmove(&pgdir[PDX(UTOP)], &boot_pgdir[PDX(UTOP)],
+		(NPDENTRIES - PDX(UTOP)) * sizeof(pde_t));
+	pgdir[PDX(VPT)] = page2pa(pp) | PTE_W | PTE_P;
+	pgdir[PDX(UVPT)] = page2pa(pp) | PTE_U | PTE_P;
+	*pgdir_store = pgdir;
+	return 0;
+}
+
+//
+// Free a page directory made by pgdir_create(), along with every user
+// mapping and user page table in it.  It must not be the page
+// directory the CPU is running on.
+//
+void
+pgdir_destroy(pde_t *pgdir)
+{
+	uint32_t pdx;
+
+	page_remove_range(pgdir, 0, UTOP);
+	pgdir_lock(pgdir);
+	for (pdx = 0; pdx < PDX(UTOP); pdx++) {
+		if (!(pgdir[pdx] & PTE_P))
+			continue;
+		assert(!(pgdir[pdx] & PTE_PS));
+		pgtable_free(pa2page(PTE_ADDR(pgdir[pdx])));
+		pgdir[pdx] = 0;
+	}
+	pgdir_unlock(pgdir);
+	page_decref(pa2page(PADDR(pgdir)));
+}
+
+//
+// Handle a page fault at kernel address 'va' whose page directory entry
+// is missing in 'pgdir' but present in boot_pgdir: copy the entry over.
+// The trap handler should try this before treating a kernel-mode
+// T_PGFLT above UTOP as fatal.
+//
+// RETURNS:
+//   0 if the entry was copied and the instruction can be restarted
+//   -E_FAULT, if boot_pgdir has no mapping there either
+//
+int
+pgdir_kern_fault(pde_t *pgdir, void *va)
+{
+	uint32_t pdx = PDX(va);
+	int r;
+
+	if ((uintptr_t) va < UTOP || pdx == PDX(VPT) || pdx == PDX(UVPT))
+		return -E_FAULT;
+	pgdir_lock(pgdir);
+	if (pgdir[pdx] & PTE_P)
+		// Another CPU got here first, or the fault is real.
+		r = pgdir[pdx] == boot_pgdir[pdx] ? 0 : -E_FAULT;
+	else if (boot_pgdir[pdx] & PTE_P) {
+		pgdir[pdx] = boot_pgdir[pdx];
+		r = 0;
+	} else
+		r = -E_FAULT;
+	pgdir_unlock(pgdir);
+	return r;
+}
+
+uint32_t tlb_flush_threshold = TLB_FLUSH_THRESHOLD;
+
+// Flush the whole TLB.  Reloading CR3 keeps global entries, so when
+// 'global' is set and global pages are on, toggle CR4_PGE instead.
+static void
+tlb_flush_all(int global)
+{
+	uint32_t cr4;
+
+	PMAP_STAT(ps_tlb_flush);
+	if (global && pte_global && ((cr4 = rcr4()) & CR4_PGE)) {
+		lcr4(cr4 & ~CR4_PGE);
+		lcr4(cr4);
+	} else
+		tlbflush();
+}
+
+//
+// Invalidate the TLB entries for [va, va+size), or the whole TLB
+// if that covers more than tlb_flush_threshold pages.
+//
+void
+tlb_invalidate_range(pde_t *pgdir, void *va, size_t size)
+{
+	uintptr_t start;
+	size_t i, n;
+
+	if (size == 0)
+		return;
+	start = ROUNDDOWN((uintptr_t) va, PGSIZE);
+	n = ROUNDUP((uintptr_t) va - start + size, PGSIZE) / PGSIZE;
+	if (pgdir != cur_pgdirs[cpunum()] && start + (n - 1) * PGSIZE < UTOP)
+		return;
+	if (n > tlb_flush_threshold) {
+		tlb_flush_all(start + (n - 1) * PGSIZE >= UTOP);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		tlb_invalidate(pgdir, (void *) (start + i * PGSIZE));
+}
+
+void
+tlb_gather_init(struct TlbGather *tg, pde_t *pgdir)
+{
+	tg->tg_pgdir = pgdir;
+	tg->tg_count = 0;
+	tg->tg_global = 0;
+}
+
+//
+// Record that 'va' was unmapped from tg's page directory.  If 'pp' is
+// not NULL, drop one reference to it once the TLB entry is gone.
+// Flushes the batch when it is full.
+//
+void
+tlb_gather_add(struct TlbGather *tg, void *va, struct Page *pp)
+{
+	if (tg->tg_count == TLB_GATHER_MAX)
+		tlb_gather_flush(tg);
+	tg->tg_va[tg->tg_count] = (uintptr_t) va;
+	tg->tg_pages[tg->tg_count] = pp;
+	tg->tg_count++;
+	if ((uintptr_t) va >= UTOP)
+		tg->tg_global = 1;
+}
+
+//
+// Invalidate every address gathered so far, then release their pages.
+// The gather can be reused afterwards.
+//
+void
+tlb_gather_flush(struct TlbGather *tg)
+{
+	uint32_t i;
+
+	if (tg->tg_count <= tlb_flush_threshold)
+		for (i = 0; i < tg->tg_count; i++)
+			tlb_invalidate(tg->tg_pgdir, (void *) tg->tg_va[i]);
+	else if (tg->tg_pgdir == cur_pgdirs[cpunum()] || tg->tg_global)
+		tlb_flush_all(tg->tg_global);
+
+	for (i = 0; i < tg->tg_count; i++)
+		if (tg->tg_pages[i])
+			page_decref(tg->tg_pages[i]);
+	tg->tg_count = 0;
+	tg->tg_global = 0;
+}
+
+// check page_insert, page_remove, &c
+static void
+page_check(void)
+{
+	struct Page *pp, *pp0, *pp1, *pp2;
+	struct Page_list fl[PAGE_NORDER];
+	struct TlbGather tg;
+	pte_t *ptep, *ptep1;
+	void *va;
+	int i;
+
+	// should be able to allocate three pages
+	pp0 = pp1 = pp2 = 0;
+	assert(page_alloc(&pp0) == 0);
+	assert(page_alloc(&pp1) == 0);
+	assert(page_alloc(&pp2) == 0);
+
+	assert(pp0);
+	assert(pp1 && pp1 != pp0);
+	assert(pp2 && pp2 != pp1 && pp2 != pp0);
+
+	// temporarily steal the rest of the free pages
+	page_free_steal(fl);
+
+	// should be no free memory
 	assert(page_alloc(&pp) == -E_NO_MEM);
 
 	// there is no page allocated at address 0
@@ -757,8 +3343,64 @@ page_check(void)
 	boot_pgdir[0] = 0;
 	pp0->pp_ref = 0;
 
+	// gathered unmaps should hold on to their pages until the flush
+	page_free(pp0);
+	assert(page_insert(boot_pgdir, pp1, 0x0, 0) == 0);
+	assert(page_insert(boot_pgdir, pp1, (void*) PGSIZE, 0) == 0);
+	tlb_gather_init(&tg, boot_pgdir);
+	page_remove_gather(&tg, 0x0);
+	page_remove_gather(&tg, (void*) PGSIZE);
+	assert(check_va2pa(boot_pgdir, 0x0) == ~0);
+	assert(check_va2pa(boot_pgdir, PGSIZE) == ~0);
+	assert(pp1->pp_ref == 2);
+	tlb_gather_flush(&tg);
+	assert(pp1->pp_ref == 0);
+	assert(page_alloc(&pp) == 0 && pp == pp1);
+
+	// range insert and remove should keep the same ref counts
+	// as single-page operations
+	boot_pgdir[0] = 0;
+	pp0->pp_ref = 0;
+	page_free(pp0);
+	{
+		struct Page *pps[3] = { pp1, pp2, pp1 };
+		assert(page_insert_range(boot_pgdir, pps, 3, 0x0, 0) == 0);
+	}
+	assert(PTE_ADDR(boot_pgdir[0]) == page2pa(pp0));
+	assert(check_va2pa(boot_pgdir, 0x0) == page2pa(pp1));
+	assert(check_va2pa(boot_pgdir, PGSIZE) == page2pa(pp2));
+	assert(check_va2pa(boot_pgdir, 2*PGSIZE) == page2pa(pp1));
+	assert(pp1->pp_ref == 2 && pp2->pp_ref == 1);
+	page_remove_range(boot_pgdir, (void*) PGSIZE, 2*PGSIZE);
+	assert(check_va2pa(boot_pgdir, 0x0) == page2pa(pp1));
+	assert(check_va2pa(boot_pgdir, PGSIZE) == ~0);
+	assert(pp1->pp_ref == 1 && pp2->pp_ref == 0);
+	assert(page_alloc(&pp) == 0 && pp == pp2);
+	page_remove(boot_pgdir, 0x0);
+	assert(page_alloc(&pp) == 0 && pp == pp1);
+
+	// an emptied page table should be reused as is
+	assert(*pgdir_walk(boot_pgdir, 0x0, 0) == 0);
+	boot_pgdir[0] = 0;
+	pgtable_free(pp0);
+	assert(pgdir_walk(boot_pgdir, 0x0, 1) == page2kva(pp0));
+	assert(pp0->pp_ref == 1);
+	boot_pgdir[0] = 0;
+	pp0->pp_ref = 0;
+
+	// reference counts go past 16 bits, and the page is freed only
+	// when the last one goes
+	pp1->pp_ref = 0xffff;
+	page_ref_inc(pp1);
+	assert(pp1->pp_ref == 0x10000);
+	pp1->pp_ref = 1;
+	page_ref_inc(pp1);
+	page_decref(pp1);
+	assert(pp1->pp_ref == 1 && pp1->pp_flags == 0);
+	pp1->pp_ref = 0;
+
 	// give free list back
-	page_free_list = fl;
+	page_free_return(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -768,3 +3410,281 @@ page_check(void)
 	cprintf("page_check() succeeded!\n");
 }
 
+// check pgdir_copy_cow and page_fault_cow
+static void
+check_cow(void)
+{
+	struct Page *pd0, *pd1, *pp, *pp0;
+	pde_t *pgdir0, *pgdir1;
+	pte_t *ptep;
+	void *va;
+
+	assert(page_alloc_zeroed(&pd0) == 0);
+	assert(page_alloc_zeroed(&pd1) == 0);
+	assert(page_alloc(&pp0) == 0);
+	pgdir0 = page2kva(pd0);
+	pgdir1 = page2kva(pd1);
+	va = (void *) (UTEXT + PGSIZE);
+
+	// only the kernel sets PTE_COW
+	assert(page_check_perm(PTE_U | PTE_P | PTE_W | PTE_USER_AVAIL) == 0);
+	assert(page_check_perm(PTE_U | PTE_P | PTE_COW) == -E_INVAL);
+	assert(!(PTE_SYSCALL & PTE_COW));
+
+	// share a writable page
+	memset(page2kva(pp0), 0x5a, PGSIZE);
+	assert(page_insert(pgdir0, pp0, va, PTE_U | PTE_W) == 0);
+	assert(pgdir_copy_cow(pgdir1, pgdir0, (void *) UTEXT, PTSIZE) == 0);
+	assert(page_lookup(pgdir1, va, &ptep) == pp0);
+	assert((*ptep & (PTE_W | PTE_COW)) == PTE_COW);
+	assert((*pgdir_walk(pgdir0, va, 0) & (PTE_W | PTE_COW)) == PTE_COW);
+	assert(pp0->pp_ref == 2);
+
+	// reads don't break the sharing
+	assert(page_fault_cow(pgdir1, va, FEC_PR) == -E_FAULT);
+
+	// a write in pgdir1 gets it a private copy
+	assert(page_fault_cow(pgdir1, va, FEC_PR | FEC_WR) == 0);
+	pp = page_lookup(pgdir1, va, &ptep);
+	assert(pp && pp != pp0 && pp->pp_ref == 1 && pp0->pp_ref == 1);
+	assert((*ptep & (PTE_W | PTE_COW | PTE_U)) == (PTE_W | PTE_U));
+	assert(*(uint32_t *) page2kva(pp) == 0x5a5a5a5a);
+
+	// the last sharer writes in place
+	assert(page_fault_cow(pgdir0, va, FEC_PR | FEC_WR) == 0);
+	assert(page_lookup(pgdir0, va, &ptep) == pp0);
+	assert((*ptep & (PTE_W | PTE_COW)) == PTE_W);
+	assert(page_fault_cow(pgdir0, va, FEC_PR | FEC_WR) == -E_FAULT);
+
+	// demand-zero pages share the zero page until written
+	assert(page_map_zero(pgdir1, (void *) UTEXT, 2 * PGSIZE,
+			     PTE_U | PTE_W) == 0);
+	assert(pp->pp_ref == 0 && page_alloc(&pp0) == 0 && pp0 == pp);
+	assert(page_lookup(pgdir1, va, &ptep) == zero_page);
+	assert(page_lookup(pgdir1, (void *) UTEXT, 0) == zero_page);
+	assert((*ptep & (PTE_W | PTE_COW)) == PTE_COW);
+	assert(zero_page->pp_ref == 1);
+	memset(page2kva(pp0), 0xa5, PGSIZE);
+	page_free(pp0);
+	assert(page_fault_cow(pgdir1, va, FEC_PR | FEC_WR) == 0);
+	pp = page_lookup(pgdir1, va, &ptep);
+	assert(pp && pp != zero_page && pp->pp_ref == 1);
+	assert((*ptep & (PTE_W | PTE_COW)) == PTE_W);
+	assert(*(uint32_t *) page2kva(pp) == 0);
+	assert(page_lookup(pgdir1, (void *) UTEXT, 0) == zero_page);
+	// copying a zero page mapping doesn't count either
+	assert(pgdir_copy_cow(pgdir0, pgdir1, (void *) UTEXT, PGSIZE) == 0);
+	assert(zero_page->pp_ref == 1);
+	page_remove(pgdir0, (void *) UTEXT);
+	page_remove(pgdir1, (void *) UTEXT);
+	assert(zero_page->pp_ref == 1);
+
+	page_remove(pgdir0, va);
+	page_remove(pgdir1, va);
+	pgtable_free(pa2page(PTE_ADDR(pgdir0[PDX(va)])));
+	pgtable_free(pa2page(PTE_ADDR(pgdir1[PDX(va)])));
+	page_free(pd0);
+	page_free(pd1);
+
+	cprintf("check_cow() succeeded!\n");
+}
+
+// check pgdir_create, pgdir_destroy and pgdir_kern_fault
+static void
+check_pgdir_create(void)
+{
+	struct Page *pp;
+	pde_t *pgdir;
+	uint32_t pdx;
+	pde_t pde;
+
+	assert(pgdir_create(&pgdir) == 0);
+	assert(pa2page(PADDR(pgdir))->pp_ref == 1);
+	for (pdx = 0; pdx < PDX(UTOP); pdx++)
+		assert(pgdir[pdx] == 0);
+	for (pdx = PDX(UTOP); pdx < NPDENTRIES; pdx++)
+		if (pdx != PDX(VPT) && pdx != PDX(UVPT))
+			assert(pgdir[pdx] == boot_pgdir[pdx]);
+	assert(check_va2pa(pgdir, KERNBASE) == 0);
+	assert(PTE_ADDR(pgdir[PDX(VPT)]) == PADDR(pgdir));
+	assert(PTE_ADDR(pgdir[PDX(UVPT)]) == PADDR(pgdir));
+
+	// a kernel entry that this page directory missed is filled in
+	// from boot_pgdir, and nothing else is
+	pde = pgdir[PDX(KSTACKTOP - 1)];
+	pgdir[PDX(KSTACKTOP - 1)] = 0;
+	assert(pgdir_kern_fault(pgdir, (void *) (KSTACKTOP - 1)) == 0);
+	assert(pgdir[PDX(KSTACKTOP - 1)] == pde);
+	assert(pgdir_kern_fault(pgdir, (void *) (KSTACKTOP - 1)) == 0);
+	assert(pgdir_kern_fault(pgdir, (void *) UTEXT) == -E_FAULT);
+	assert(pgdir_kern_fault(pgdir, (void *) UVPT) == -E_FAULT);
+
+	// destroying it frees its user page tables and pages
+	assert(page_alloc(&pp) == 0);
+	assert(page_insert(pgdir, pp, (void *) UTEXT, PTE_U | PTE_W) == 0);
+	assert(pp->pp_ref == 1 && (pgdir[PDX(UTEXT)] & PTE_P));
+	page_ref_inc(pp);
+	pgdir_destroy(pgdir);
+	assert(pp->pp_ref == 1);
+	page_decref(pp);
+
+	cprintf("check_pgdir_create() succeeded!\n");
+}
+
+// check 4MB user pages: page_insert with PTE_PS, page_lookup, page_remove,
+// copy-on-write
+static void
+check_page_large(void)
+{
+	struct Page *pp, *lp;
+	pde_t *pgdir, *child;
+	pte_t *pte;
+	uintptr_t va = UTEXT;
+
+	assert(pgdir_create(&pgdir) == 0);
+	assert(page_alloc_order(PAGE_LARGE_ORDER, &lp) == 0);
+	if (!pse_enabled) {
+		assert(page_insert(pgdir, lp, (void *) va,
+				   PTE_U | PTE_W | PTE_PS) == -E_INVAL);
+		page_free_order(lp, PAGE_LARGE_ORDER);
+		pgdir_destroy(pgdir);
+		cprintf("check_page_large() skipped: no 4MB pages\n");
+		return;
+	}
+
+	// a block with a page in use elsewhere is refused, and left alone
+	lp[3].pp_ref = 1;
+	assert(page_insert(pgdir, lp, (void *) va,
+			   PTE_U | PTE_W | PTE_PS) == -E_INVAL);
+	assert(pgdir[PDX(va)] == 0 && lp->pp_order == 0 && lp->pp_ref == 0);
+	lp[3].pp_ref = 0;
+
+	// the 4MB page replaces the page table, and the page, under it
+	assert(page_alloc(&pp) == 0);
+	assert(page_insert(pgdir, pp, (void *) (va + PGSIZE), PTE_U | PTE_W) == 0);
+	page_ref_inc(pp);
+	assert(page_insert(pgdir, lp, (void *) va, PTE_U | PTE_W | PTE_PS) == 0);
+	assert(pp->pp_ref == 1);
+	page_decref(pp);
+	assert(lp->pp_ref == 1);
+	assert(pgdir[PDX(va)] == (page2pa(lp) | PTE_U | PTE_W | PTE_PS | PTE_P));
+	assert(check_va2pa(pgdir, va + 5 * PGSIZE) == page2pa(lp + 5));
+	assert(page_lookup(pgdir, (void *) (va + 5 * PGSIZE), &pte) == lp + 5);
+	assert(pte == &pgdir[PDX(va)]);
+
+	// misaligned 4MB pages and 4KB pages inside one are refused
+	assert(page_insert(pgdir, lp, (void *) (va + PGSIZE),
+			   PTE_U | PTE_PS) == -E_INVAL);
+	assert(page_insert(pgdir, lp + 1, (void *) (va + PTSIZE),
+			   PTE_U | PTE_PS) == -E_INVAL);
+	assert(page_insert(pgdir, lp, (void *) UTOP, PTE_U | PTE_PS) == -E_INVAL);
+	assert(page_alloc(&pp) == 0);
+	assert(page_insert(pgdir, pp, (void *) (va + PGSIZE), PTE_U) == -E_INVAL);
+	page_free(pp);
+	assert(page_insert(pgdir, lp + 5, (void *) (va + 2 * PTSIZE),
+			   PTE_U) == -E_INVAL);
+	assert(page_insert_range(pgdir, &lp, 1, (void *) (va + 2 * PTSIZE),
+				 PTE_U) == -E_INVAL);
+
+	// a copy shares it copy-on-write, and a write copies all of it
+	assert(pgdir_create(&child) == 0);
+	*(uint32_t *) page2kva(lp + 5) = 0x1234;
+	assert(pgdir_copy_cow(child, pgdir, (void *) va, PGSIZE) == -E_INVAL);
+	assert(pgdir_copy_cow(child, pgdir, (void *) va, PTSIZE) == 0);
+	assert(lp->pp_ref == 2 && child[PDX(va)] == pgdir[PDX(va)]);
+	assert((pgdir[PDX(va)] & (PTE_W | PTE_COW)) == PTE_COW);
+	assert(page_fault_cow(child, (void *) (va + 5 * PGSIZE),
+			      FEC_PR | FEC_WR) == 0);
+	assert(lp->pp_ref == 1 && (child[PDX(va)] & PTE_W));
+	pp = pa2page(PDE_LARGE_ADDR(child[PDX(va)]));
+	assert(pp != lp && *(uint32_t *) page2kva(pp + 5) == 0x1234);
+	// the last sharer just gets write access back
+	assert(page_fault_cow(pgdir, (void *) va, FEC_PR | FEC_WR) == 0);
+	assert(pgdir[PDX(va)] == (page2pa(lp) | PTE_U | PTE_W | PTE_PS | PTE_P));
+	pgdir_destroy(child);
+	assert(pp->pp_flags & PP_FREE);
+
+	// re-inserting it keeps one reference; another mapping adds one
+	assert(page_insert(pgdir, lp, (void *) va, PTE_U | PTE_PS) == 0);
+	assert(lp->pp_ref == 1 && !(pgdir[PDX(va)] & PTE_W));
+	assert(page_insert(pgdir, lp, (void *) (va + PTSIZE),
+			   PTE_U | PTE_W | PTE_PS) == 0);
+	assert(lp->pp_ref == 2);
+
+	// removing any address in it unmaps all of it, and the last
+	// mapping to go frees the block (order 10 blocks don't merge)
+	page_remove(pgdir, (void *) (va + 7 * PGSIZE));
+	assert(pgdir[PDX(va)] == 0 && lp->pp_ref == 1);
+	pgdir_destroy(pgdir);
+	assert((lp->pp_flags & PP_FREE) && lp[5].pp_order == 0);
+
+	cprintf("check_page_large() succeeded!\n");
+}
+
+// check page_alloc_color and page_color_mode
+static void
+check_page_color(void)
+{
+	struct Page *pps[2 * PAGE_NCOLOR], *pp;
+	int i, color;
+
+	page_color_set(1);
+	for (i = 0; i < 2 * PAGE_NCOLOR; i++)
+		assert(page_alloc(&pps[i]) == 0);
+	// consecutive allocations rotate through the colors
+	color = page2ppn(pps[0]) % PAGE_NCOLOR;
+	for (i = 0; i < 2 * PAGE_NCOLOR; i++)
+		assert(page2ppn(pps[i]) % PAGE_NCOLOR
+		       == (color + i) % PAGE_NCOLOR);
+	// so do zeroed ones, which skip the zero pool
+	assert(page_alloc_zeroed(&pp) == 0);
+	assert(page2ppn(pp) % PAGE_NCOLOR == color);
+	page_free(pp);
+	assert(page_alloc_color(3, &pp) == 0);
+	assert(page2ppn(pp) % PAGE_NCOLOR == 3 && pp->pp_ref == 0);
+	page_free(pp);
+	assert(pp->pp_flags == PP_CACHED);
+	for (i = 0; i < 2 * PAGE_NCOLOR; i++)
+		page_free(pps[i]);
+
+	// turning coloring off gives the pages back
+	page_color_set(0);
+	assert(page_ncolored == 0);
+	assert(pp->pp_flags != PP_CACHED);
+
+	cprintf("check_page_color() succeeded!\n");
+}
+
+// check that pgdir_walk goes through vpt[] for the loaded page directory,
+// and agrees with the walk through KADDR
+static void
+check_vpt_walk(void)
+{
+	struct Page *pp;
+	pte_t *ptep, *kptep;
+	void *va = (void *) UTEXT;
+
+	assert(!(boot_pgdir[PDX(va)] & PTE_P));
+	assert(page_alloc(&pp) == 0);
+	assert(page_insert(boot_pgdir, pp, va, PTE_W) == 0);
+	ptep = pgdir_walk(boot_pgdir, va, 0);
+	kptep = (pte_t *) KADDR(PTE_ADDR(boot_pgdir[PDX(va)])) + PTX(va);
+	assert(ptep == &vpt[VPN(va)]);
+	assert(*ptep == *kptep && PTE_ADDR(*ptep) == page2pa(pp));
+	assert(page_lookup(boot_pgdir, va, 0) == pp);
+
+	// writes through vpt[] reach the page, and 4MB pages come back
+	// as their PDE
+	*(uint32_t *) va = 0x12345678;
+	assert(*(uint32_t *) page2kva(pp) == 0x12345678);
+	assert(pgdir_walk(boot_pgdir, (void *) KERNBASE, 0)
+	       == &vpd[PDX(KERNBASE)] || !(boot_pgdir[PDX(KERNBASE)] & PTE_PS));
+
+	page_remove(boot_pgdir, va);
+	assert(pp->pp_ref == 0);
+	pgtable_free(pa2page(PTE_ADDR(boot_pgdir[PDX(va)])));
+	boot_pgdir[PDX(va)] = 0;
+	tlb_invalidate(boot_pgdir, (void *) &vpt[VPN(va)]);
+
+	cprintf("check_vpt_walk() succeeded!\n");
+}
@@ -8,6 +8,7 @@
 
 #include <inc/memlayout.h>
 #include <inc/assert.h>
+#include <inc/x86.h>
 
 
 /* This macro takes a kernel virtual address -- an address that points above
@@ -36,6 +37,77 @@
 
 
 
+// The buddy allocator hands out naturally aligned blocks of 2^order
+// pages, for 0 <= order <= PAGE_MAX_ORDER.  The largest block covers
+// one page table's worth of memory (PTSIZE), i.e. one 4MB superpage.
+#define PAGE_MAX_ORDER	10
+#define PAGE_NORDER	(PAGE_MAX_ORDER + 1)
+
+// A 4MB user page (page_insert() with PTE_PS) is backed by one block
+// of this order, and its reference count lives in the block's first page.
+#define PAGE_LARGE_ORDER	(PTSHIFT - PGSHIFT)
+
+// Each CPU caches up to PAGE_MAG_SIZE free pages in a "magazine" in
+// front of the buddy lists, and refills or drains it PAGE_MAG_BATCH
+// pages at a time.
+#define PAGE_MAG_SIZE	32
+#define PAGE_MAG_BATCH	16
+
+// Page coloring (see page_alloc_color()).  A page's color is its
+// physical page number modulo PAGE_NCOLOR = 2^PAGE_COLOR_ORDER, which
+// fits a cache of up to PAGE_NCOLOR * PGSIZE bytes per way.  Each color
+// list holds at most PAGE_COLOR_MAX freed pages.
+#define PAGE_COLOR_ORDER	4
+#define PAGE_NCOLOR		(1 << PAGE_COLOR_ORDER)
+#define PAGE_COLOR_MAX		64
+
+// Size of a cache line.  Per-CPU data is aligned to it, so that one
+// CPU's updates don't steal the line holding another CPU's slot.
+#define CACHE_LINE		64
+
+// page_color_bench() maps at most PAGE_COLOR_BENCH_MAX pages, and reads
+// PAGE_COLOR_BENCH_LINES CACHE_LINE-byte cache lines from each.
+#define PAGE_COLOR_BENCH_MAX	1024
+#define PAGE_COLOR_BENCH_LINES	8
+
+// Number of free pages the idle loop keeps zeroed ahead of time
+// for page_alloc_zeroed().
+#define PAGE_ZERO_TARGET	64
+
+// pgdir_walk() takes new page tables from a quicklist of cleared pages,
+// refilled and trimmed PGTABLE_QUICK_BATCH pages at a time and holding
+// at most PGTABLE_QUICK_MAX pages.
+#define PGTABLE_QUICK_MAX	32
+#define PGTABLE_QUICK_BATCH	8
+
+// Invalidating more than this many pages at once flushes the whole TLB
+// instead (default for the tunable tlb_flush_threshold).
+#define TLB_FLUSH_THRESHOLD	32
+
+// Page directories hash to this many locks; see the locking notes at the
+// top of kern/pmap.c.
+#define PGDIR_NLOCK	64
+
+// Build with DEFS=-DPAGE_REF_DEBUG to catch reference count updates on
+// free pages, decrements below zero, and page tables freed with
+// mappings left in them.
+
+// A TLB gather batches the invalidations of a run of page_remove_gather()
+// calls.  The unmapped pages keep their references until the batch is
+// flushed, so no page is reused while a stale TLB entry may point to it.
+#define TLB_GATHER_MAX	64
+
+struct TlbGather {
+	pde_t *tg_pgdir;
+	uint32_t tg_count;			// Pending invalidations
+	int tg_global;				// Any pending va at or above UTOP?
+	uintptr_t tg_va[TLB_GATHER_MAX];	// Unmapped addresses
+	struct Page *tg_pages[TLB_GATHER_MAX];	// Pages they mapped, or NULL
+};
+
+// page_print_map() lists at most this many runs of pages by default.
+#define PAGE_MAP_MAXRUNS	64
+
 extern char bootstacktop[], bootstack[];
 
 extern struct Page *pages;
@@ -44,6 +116,10 @@ extern size_t npage;
 extern physaddr_t boot_cr3;
 extern pde_t *boot_pgdir;
 
+extern uint32_t tlb_flush_threshold;
+extern int page_color_mode;
+extern struct Page *zero_page;
+
 extern struct Segdesc gdt[];
 extern struct Pseudodesc gdt_pd;
 
@@ -53,12 +129,47 @@ void	i386_detect_memory();
 void	page_init(void);
 int	page_alloc(struct Page **pp_store);
 void	page_free(struct Page *pp);
+int	page_alloc_order(int order, struct Page **pp_store);
+void	page_free_order(struct Page *pp, int order);
+int	page_alloc_batch(struct Page **out, size_t n);
+void	page_free_batch(struct Page **pps, size_t n);
+void	page_mag_drain(void);
+void	page_mag_print_stats(void);
+int	page_alloc_color(int color, struct Page **pp_store);
+void	page_color_set(int on);
+void	page_color_print_stats(void);
+void	page_color_bench(size_t npage, int rounds);
+int	page_alloc_zeroed(struct Page **pp_store);
+void	page_zero_idle(void);
+void	page_zero_print_stats(void);
+void	pgtable_free(struct Page *pp);
+void	pgtable_print_stats(void);
+void	pmap_print_stats(void);
+void	page_print_map(int maxruns);
+void	pmap_reset_stats(void);
+void	boot_map_bench(void);
+int	page_check_perm(int perm);
 int	page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct Page *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct Page *pp);
 
+void	page_remove_gather(struct TlbGather *tg, void *va);
+int	page_insert_range(pde_t *pgdir, struct Page **pps, size_t n,
+			  void *va, int perm);
+void	page_remove_range(pde_t *pgdir, void *va, size_t size);
+int	pgdir_copy_cow(pde_t *dst, pde_t *src, void *va, size_t size);
+int	page_fault_cow(pde_t *pgdir, void *va, uint32_t err);
+int	page_map_zero(pde_t *pgdir, void *va, size_t size, int perm);
+int	pgdir_create(pde_t **pgdir_store);
+void	pgdir_destroy(pde_t *pgdir);
+int	pgdir_kern_fault(pde_t *pgdir, void *va);
+
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_invalidate_range(pde_t *pgdir, void *va, size_t size);
+void	tlb_gather_init(struct TlbGather *tg, pde_t *pgdir);
+void	tlb_gather_add(struct TlbGather *tg, void *va, struct Page *pp);
+void	tlb_gather_flush(struct TlbGather *tg);
 
 static inline ppn_t
 page2ppn(struct Page *pp)
@@ -86,6 +197,81 @@ page2kva(struct Page *pp)
 	return KADDR(page2pa(pp));
 }
 
+// Take a reference to an allocated page.  Safe against concurrent
+// page_ref_inc() and page_decref() calls on other CPUs.  Like
+// page_decref(), ignores the shared zero page.
+static inline void
+page_ref_inc(struct Page *pp)
+{
+	if (pp == zero_page)
+		return;
+#ifdef PAGE_REF_DEBUG
+	if (pp->pp_flags & (PP_FREE | PP_CACHED | PP_ZERO))
+		panic("page_ref_inc: page %08x is free", page2pa(pp));
+#endif
+	xadd(&pp->pp_ref, 1);
+}
+
+// Lists of pages linked through the pp_next/pp_prev page numbers.
+
+static inline void
+page_list_init(struct Page_list *list)
+{
+	list->pl_first = PAGE_NIL;
+}
+
+static inline int
+page_list_empty(struct Page_list *list)
+{
+	return list->pl_first == PAGE_NIL;
+}
+
+static inline struct Page *
+page_list_first(struct Page_list *list)
+{
+	return list->pl_first == PAGE_NIL ? NULL : &pages[list->pl_first];
+}
+
+static inline struct Page *
+page_list_next(struct Page *pp)
+{
+	return pp->pp_next == PAGE_NIL ? NULL : &pages[pp->pp_next];
+}
+
+static inline void
+page_list_insert_head(struct Page_list *list, struct Page *pp)
+{
+	ppn_t ppn = page2ppn(pp);
+
+	pp->pp_next = list->pl_first;
+	pp->pp_prev = PAGE_NIL;
+	if (list->pl_first != PAGE_NIL)
+		pages[list->pl_first].pp_prev = ppn;
+	list->pl_first = ppn;
+}
+
+static inline void
+page_list_remove(struct Page_list *list, struct Page *pp)
+{
+	if (pp->pp_prev == PAGE_NIL)
+		list->pl_first = pp->pp_next;
+	else
+		pages[pp->pp_prev].pp_next = pp->pp_next;
+	if (pp->pp_next != PAGE_NIL)
+		pages[pp->pp_next].pp_prev = pp->pp_prev;
+	// The link shares its word with pp_ref: leave a count of 0.
+	pp->pp_next = 0;
+}
+
+#define PAGE_LIST_FOREACH(var, list)					\
+	for ((var) = page_list_first(list);				\
+	     (var);							\
+	     (var) = page_list_next(var))
+
+void	pgdir_load(pde_t *pgdir);
+void	pgdir_lock(pde_t *pgdir);
+void	pgdir_unlock(pde_t *pgdir);
 pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
+pte_t *pgdir_walk_locked(pde_t *pgdir, const void *va, int create);
 
 #endif /* !JOS_KERN_PMAP_H */
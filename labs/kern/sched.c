@@ -0,0 +1,227 @@
+/* See COPYRIGHT for copyright information. */
+
+// Priority run queues.
+//
+// Each priority has a FIFO queue of its runnable environments, and
+// sched_ready has bit p set while queue p is non-empty.  Picking the
+// next environment is thus a bsf on sched_ready and a look at the head
+// of that queue, whatever the number of environments, instead of a
+// scan over all NENV slots of envs[].  Within a priority, environments
+// take turns round robin; a lower priority only runs while every
+// higher one is empty.
+//
+// An environment is on its run queue exactly while it is runnable:
+// whoever sets env_status to ENV_RUNNABLE calls sched_enqueue(), and
+// whoever takes it away calls sched_dequeue().  The running
+// environment stays queued, as in sched_yield()'s usual convention.
+
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/selftest.h>
+
+// Timer ticks per time slice, by priority.  Higher priorities get
+// shorter slices, so they are preempted (and rotated) more often;
+// lower ones run longer when they get the CPU at all.
+const uint32_t sched_slices[SCHED_NPRIO] = {
+	1, 1, 2, 2, 4, 4, 8, 8
+};
+
+// sched_lock guards the run queues, sched_ready and the counters.
+static struct Spinlock sched_lock = SPINLOCK_INIT("sched_lock");
+static struct Env_runq sched_runqs[SCHED_NPRIO];
+static uint32_t sched_ready;
+
+// Usage statistics, by priority
+static uint32_t sched_nqueued[SCHED_NPRIO];	// Environments queued
+static uint32_t sched_npicks[SCHED_NPRIO];	// sched_pick() results
+
+static void check_sched(void);
+
+void
+sched_init(void)
+{
+	int p;
+
+	for (p = 0; p < SCHED_NPRIO; p++)
+		TAILQ_INIT(&sched_runqs[p]);
+	selftest_run("check_sched", check_sched, SELFTEST_QUICK);
+}
+
+static void
+sched_enqueue_locked(struct Env *e)
+{
+	if (e->env_runq_link.tqe_prev != NULL)
+		panic("sched_enqueue: env %08x is already queued", e->env_id);
+	if (e->env_prio >= SCHED_NPRIO)
+		panic("sched_enqueue: env %08x has bad priority %u",
+		      e->env_id, e->env_prio);
+	TAILQ_INSERT_TAIL(&sched_runqs[e->env_prio], e, env_runq_link);
+	sched_nqueued[e->env_prio]++;
+	sched_ready |= 1 << e->env_prio;
+}
+
+static void
+sched_dequeue_locked(struct Env *e)
+{
+	TAILQ_REMOVE(&sched_runqs[e->env_prio], e, env_runq_link);
+	e->env_runq_link.tqe_prev = NULL;
+	if (--sched_nqueued[e->env_prio] == 0)
+		sched_ready &= ~(1 << e->env_prio);
+}
+
+//
+// Put runnable environment 'e' at the tail of its priority's queue,
+// with a full time slice.
+//
+void
+sched_enqueue(struct Env *e)
+{
+	spin_lock(&sched_lock);
+	sched_enqueue_locked(e);
+	e->env_slice = sched_slices[e->env_prio];
+	spin_unlock(&sched_lock);
+}
+
+//
+// Take 'e' off its run queue, e.g. because it blocked or is being
+// destroyed.  Does nothing if 'e' is not queued.
+//
+void
+sched_dequeue(struct Env *e)
+{
+	spin_lock(&sched_lock);
+	if (e->env_runq_link.tqe_prev != NULL)
+		sched_dequeue_locked(e);
+	spin_unlock(&sched_lock);
+}
+
+//
+// Change the priority of 'e' to 'prio'.  A queued environment moves
+// to the tail of its new queue.
+//
+void
+sched_set_prio(struct Env *e, uint32_t prio)
+{
+	assert(prio < SCHED_NPRIO);
+	spin_lock(&sched_lock);
+	if (e->env_runq_link.tqe_prev != NULL) {
+		sched_dequeue_locked(e);
+		e->env_prio = prio;
+		sched_enqueue_locked(e);
+	} else
+		e->env_prio = prio;
+	spin_unlock(&sched_lock);
+}
+
+//
+// Choose the environment to run next: the one at the head of the
+// highest-priority non-empty queue.  It moves to the tail of its
+// queue, so the next pick at that priority goes to another one, and
+// gets a fresh time slice.
+//
+// RETURNS:
+//   the environment to run, or NULL if nothing is runnable
+//
+struct Env *
+sched_pick(void)
+{
+	struct Env *e;
+	uint32_t p;
+
+	spin_lock(&sched_lock);
+	if (sched_ready == 0) {
+		spin_unlock(&sched_lock);
+		return NULL;
+	}
+	p = bsf(sched_ready);
+	e = TAILQ_FIRST(&sched_runqs[p]);
+	if (TAILQ_NEXT(e, env_runq_link) != NULL) {
+		TAILQ_REMOVE(&sched_runqs[p], e, env_runq_link);
+		TAILQ_INSERT_TAIL(&sched_runqs[p], e, env_runq_link);
+	}
+	e->env_slice = sched_slices[p];
+	sched_npicks[p]++;
+	spin_unlock(&sched_lock);
+	return e;
+}
+
+//
+// Charge the running environment 'e' for one timer tick.
+//
+// RETURNS:
+//   1 if its time slice is used up and the caller should yield
+//   0 otherwise
+//
+int
+sched_tick(struct Env *e)
+{
+	if (e->env_slice > 0)
+		e->env_slice--;
+	return e->env_slice == 0;
+}
+
+//
+// Print the depth of each run queue.
+//
+void
+sched_print_stats(void)
+{
+	int p;
+
+	spin_lock(&sched_lock);
+	cprintf("prio  slice  queued      picks\n");
+	for (p = 0; p < SCHED_NPRIO; p++)
+		cprintf("%4d %6u %7u %10u\n", p, sched_slices[p],
+			sched_nqueued[p], sched_npicks[p]);
+	spin_unlock(&sched_lock);
+}
+
+// check the run queues: priority order, round robin and time slices
+static void
+check_sched(void)
+{
+	struct Env es[3], *a, *b, *c;
+	uint32_t i;
+
+	memset(es, 0, sizeof(es));
+	a = &es[0];
+	b = &es[1];
+	c = &es[2];
+	a->env_prio = b->env_prio = SCHED_PRIO_DEFAULT;
+	c->env_prio = SCHED_PRIO_DEFAULT - 2;
+	assert(sched_pick() == NULL);
+
+	// the higher priority runs first, and keeps the CPU
+	sched_enqueue(a);
+	sched_enqueue(b);
+	sched_enqueue(c);
+	assert(sched_pick() == c);
+	assert(sched_pick() == c);
+
+	// equal priorities take turns
+	sched_dequeue(c);
+	sched_dequeue(c);
+	assert(sched_pick() == a);
+	assert(sched_pick() == b);
+	assert(sched_pick() == a);
+
+	// a raised priority takes effect at once
+	sched_set_prio(b, 0);
+	assert(sched_pick() == b);
+	for (i = 1; i < sched_slices[0]; i++)
+		assert(sched_tick(b) == 0);
+	assert(sched_tick(b) == 1);
+
+	sched_dequeue(a);
+	sched_dequeue(b);
+	assert(sched_pick() == NULL);
+	assert(sched_ready == 0);
+	memset(sched_npicks, 0, sizeof(sched_npicks));
+
+	cprintf("check_sched() succeeded!\n");
+}
@@ -0,0 +1,28 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SCHED_H
+#define JOS_KERN_SCHED_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+// Priorities run from 0 (highest) to SCHED_NPRIO - 1 (lowest).
+// New environments start at SCHED_PRIO_DEFAULT.
+#define SCHED_NPRIO		8
+#define SCHED_PRIO_DEFAULT	4
+
+TAILQ_HEAD(Env_runq, Env);
+
+extern const uint32_t sched_slices[SCHED_NPRIO];
+
+void	sched_init(void);
+void	sched_enqueue(struct Env *e);
+void	sched_dequeue(struct Env *e);
+void	sched_set_prio(struct Env *e, uint32_t prio);
+struct Env *sched_pick(void);
+int	sched_tick(struct Env *e);
+void	sched_print_stats(void);
+
+#endif /* !JOS_KERN_SCHED_H */
@@ -0,0 +1,117 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/x86.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/memlayout.h>
+#include <inc/multiboot.h>
+
+#include <kern/selftest.h>
+
+int selftest_depth = SELFTEST_DEFAULT;
+
+// Every self-test that selftest_run() was asked to run, in order.
+static struct SelfTest selftests[SELFTEST_MAX];
+static int nselftests;
+
+static const char *const selftest_depth_names[] = {
+	[SELFTEST_NONE] = "none",
+	[SELFTEST_QUICK] = "quick",
+	[SELFTEST_FULL] = "full",
+};
+
+//
+// Pick the self-test depth from a "selftest=" option on the kernel
+// command line, if a Multiboot loader passed one.  Must be called
+// before paging is on, while physical memory is reached through the
+// KERNBASE segment, like i386_detect_memory().
+//
+void
+selftest_init(void)
+{
+	struct MultibootInfo *mbi;
+	const char *cmdline, *opt;
+	size_t n;
+	int d;
+
+	if (multiboot_magic != MULTIBOOT_BOOTLOADER_MAGIC
+	    || multiboot_info >= (physaddr_t) -KERNBASE)
+		return;
+	mbi = (struct MultibootInfo *) (KERNBASE + multiboot_info);
+	if (!(mbi->mbi_flags & MULTIBOOT_INFO_CMDLINE)
+	    || mbi->mbi_cmdline >= (physaddr_t) -KERNBASE)
+		return;
+	cmdline = (const char *) (KERNBASE + mbi->mbi_cmdline);
+
+	for (opt = cmdline; *opt; opt++) {
+		if ((opt != cmdline && opt[-1] != ' ')
+		    || strncmp(opt, "selftest=", 9) != 0)
+			continue;
+		opt += 9;
+		// The name has to end the option: "selftest=fullest" is
+		// no depth at all.
+		for (d = SELFTEST_NONE; d <= SELFTEST_FULL; d++) {
+			n = strlen(selftest_depth_names[d]);
+			if (strncmp(opt, selftest_depth_names[d], n) == 0
+			    && (opt[n] == ' ' || opt[n] == '\0'))
+				break;
+		}
+		if (d > SELFTEST_FULL)
+			warn("selftest_init: unknown depth in '%s'", opt);
+		else
+			selftest_depth = d;
+		break;
+	}
+}
+
+//
+// Run self-test 'func' if the selected depth is at least 'mindepth'
+// (which is SELFTEST_QUICK or SELFTEST_FULL), and record how many
+// cycles it took under 'name'.
+//
+void
+selftest_run(const char *name, selftest_func_t func, int mindepth)
+{
+	struct SelfTest *st;
+	uint64_t tsc;
+
+	if (nselftests == SELFTEST_MAX)
+		panic("selftest_run: too many self-tests");
+	st = &selftests[nselftests++];
+	st->st_name = name;
+	st->st_mindepth = mindepth;
+	st->st_ran = selftest_depth >= mindepth;
+	st->st_cycles = 0;
+	if (!st->st_ran)
+		return;
+
+	tsc = read_tsc();
+	func();
+	st->st_cycles = read_tsc() - tsc;
+}
+
+//
+// Print the cycles each self-test took.
+//
+void
+selftest_print_summary(void)
+{
+	uint64_t total;
+	int i;
+
+	cprintf("self-tests (depth %s):\n",
+		selftest_depth_names[selftest_depth]);
+	total = 0;
+	for (i = 0; i < nselftests; i++) {
+		if (selftests[i].st_ran) {
+			cprintf("  %-20s %10u kcycles\n", selftests[i].st_name,
+				(uint32_t) (selftests[i].st_cycles >> 10));
+			total += selftests[i].st_cycles;
+		} else
+			cprintf("  %-20s    skipped (needs %s)\n",
+				selftests[i].st_name,
+				selftest_depth_names[selftests[i].st_mindepth]);
+	}
+	cprintf("  %-20s %10u kcycles\n", "total", (uint32_t) (total >> 10));
+}
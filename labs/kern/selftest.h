@@ -0,0 +1,41 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SELFTEST_H
+#define JOS_KERN_SELFTEST_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// How thoroughly the boot-time self-tests run, chosen with
+// "selftest=none|quick|full" on the kernel command line.
+#define SELFTEST_NONE	0	// Skip every test
+#define SELFTEST_QUICK	1	// Only tests that take constant time
+#define SELFTEST_FULL	2	// Everything, including O(npage) sweeps
+
+// Default depth when the command line doesn't choose one
+#define SELFTEST_DEFAULT	SELFTEST_FULL
+
+// Maximum number of self-tests whose results are kept
+#define SELFTEST_MAX	32
+
+// A self-test is registered at the lowest depth it runs at: a check
+// that sweeps over every page goes in a test of its own at
+// SELFTEST_FULL, apart from the constant-time checks at SELFTEST_QUICK.
+typedef void (*selftest_func_t)(void);
+
+struct SelfTest {
+	const char *st_name;
+	int st_mindepth;		// Lowest depth the test runs at
+	int st_ran;			// Did it run?
+	uint64_t st_cycles;		// TSC cycles it took
+};
+
+extern int selftest_depth;
+
+void	selftest_init(void);
+void	selftest_run(const char *name, selftest_func_t func, int mindepth);
+void	selftest_print_summary(void);
+
+#endif	// !JOS_KERN_SELFTEST_H
@@ -0,0 +1,377 @@
+/* See COPYRIGHT for copyright information. */
+
+// Slab allocator for kernel objects, built on top of page_alloc().
+//
+// Every slab is one physical page, used through its KERNBASE mapping.
+// The page starts with a struct Slab header, then one uint16_t free
+// list link per object, then the objects themselves.  Keeping the
+// links out of the objects means a free object keeps whatever state
+// its cache's constructor gave it.
+//
+// malloc() and free() sit on a set of power-of-two size-class caches.
+// Since a slab header always sits at the start of its page, free()
+// finds the owning slab by rounding the address down to a page.
+
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/malloc.h>
+
+#include <kern/pmap.h>
+#include <kern/slab.h>
+#include <kern/selftest.h>
+
+#define SLAB_MAGIC	0x51AB51AB	// Start of a slab page
+#define BIGBLOCK_MAGIC	0xB16B10CC	// Start of a large malloc() block
+#define SLAB_NIL	0xFFFF		// End of a slab's free object list
+
+struct Slab {
+	uint32_t sl_magic;		// SLAB_MAGIC
+	struct KmemCache *sl_cache;	// Cache this slab belongs to
+	LIST_ENTRY(Slab) sl_link;	// Link on kc_partial or kc_full
+	uint16_t sl_inuse;		// Objects allocated from this slab
+	uint16_t sl_free;		// First free object, or SLAB_NIL
+	uint16_t sl_next[];		// Free list links, one per object
+};
+
+// Header in front of a malloc() block too big for the size classes.
+struct BigBlock {
+	uint32_t bb_magic;		// BIGBLOCK_MAGIC
+	uint32_t bb_order;		// The block is 2^bb_order pages
+	uint32_t bb_size;		// Size that was asked for
+	uint32_t bb_pad;		// Keep the data 16-byte aligned
+};
+
+static struct KmemCache kmem_caches[KMEM_MAX_CACHES];
+static int kmem_ncaches;
+
+// malloc() size classes: 16, 32, ..., KMEM_MAX_SMALL bytes.
+#define KMEM_MIN_SHIFT	4
+#define KMEM_NCLASSES	7
+static struct KmemCache *kmem_classes[KMEM_NCLASSES];
+static const char *kmem_class_names[KMEM_NCLASSES] = {
+	"size-16", "size-32", "size-64", "size-128",
+	"size-256", "size-512", "size-1024"
+};
+
+static void check_kmem(void);
+
+static inline void *
+slab_obj(struct KmemCache *cache, struct Slab *slab, uint32_t i)
+{
+	return (char *) slab + cache->kc_offset + i * cache->kc_size;
+}
+
+//
+// Set up malloc()'s size-class caches.
+//
+void
+kmem_init(void)
+{
+	int c;
+
+	static_assert((1 << (KMEM_MIN_SHIFT + KMEM_NCLASSES - 1)) == KMEM_MAX_SMALL);
+
+	for (c = 0; c < KMEM_NCLASSES; c++) {
+		kmem_classes[c] = kmem_cache_create(kmem_class_names[c],
+						    1 << (KMEM_MIN_SHIFT + c),
+						    0, NULL);
+		if (!kmem_classes[c])
+			panic("kmem_init: can't create %s", kmem_class_names[c]);
+	}
+
+	selftest_run("check_kmem", check_kmem, SELFTEST_QUICK);
+}
+
+//
+// Create a cache of objects of 'size' bytes, each aligned to 'align'
+// bytes (a power of two; 0 means 8).  If 'ctor' is not NULL, it is
+// called on every object when its slab is created; see kern/slab.h.
+//
+// Returns NULL if there are too many caches, or if not even one
+// object fits in a slab.
+//
+struct KmemCache *
+kmem_cache_create(const char *name, size_t size, size_t align,
+		  void (*ctor)(void *))
+{
+	struct KmemCache *cache;
+	uint32_t n;
+
+	if (align == 0)
+		align = 8;
+	assert((align & (align - 1)) == 0);
+	if (kmem_ncaches == KMEM_MAX_CACHES)
+		return NULL;
+
+	size = ROUNDUP(MAX(size, (size_t) 1), align);
+	if (size > PGSIZE)
+		return NULL;
+
+	// As many objects as fit after the header and their links.
+	for (n = PGSIZE / size; n > 0; n--)
+		if (ROUNDUP(sizeof(struct Slab) + n * sizeof(uint16_t), align)
+		    + n * size <= PGSIZE)
+			break;
+	if (n == 0)
+		return NULL;
+
+	cache = &kmem_caches[kmem_ncaches++];
+	memset(cache, 0, sizeof(*cache));
+	cache->kc_name = name;
+	cache->kc_size = size;
+	cache->kc_align = align;
+	cache->kc_perslab = n;
+	cache->kc_offset = ROUNDUP(sizeof(struct Slab) + n * sizeof(uint16_t),
+				   align);
+	cache->kc_ctor = ctor;
+	LIST_INIT(&cache->kc_partial);
+	LIST_INIT(&cache->kc_full);
+	return cache;
+}
+
+//
+// Get a new slab for 'cache' from the page allocator,
+// with all its objects free (and constructed).
+//
+static struct Slab *
+kmem_slab_create(struct KmemCache *cache)
+{
+	struct Page *pp;
+	struct Slab *slab;
+	uint32_t i;
+
+	if (page_alloc(&pp) < 0)
+		return NULL;
+	slab = page2kva(pp);
+	slab->sl_magic = SLAB_MAGIC;
+	slab->sl_cache = cache;
+	slab->sl_inuse = 0;
+	slab->sl_free = 0;
+	for (i = 0; i < cache->kc_perslab; i++)
+		slab->sl_next[i] = (i + 1 < cache->kc_perslab) ? i + 1 : SLAB_NIL;
+	if (cache->kc_ctor)
+		for (i = 0; i < cache->kc_perslab; i++)
+			cache->kc_ctor(slab_obj(cache, slab, i));
+	cache->kc_nslabs++;
+	return slab;
+}
+
+//
+// Give an empty slab's page back to the page allocator.
+//
+static void
+kmem_slab_destroy(struct KmemCache *cache, struct Slab *slab)
+{
+	slab->sl_magic = 0;
+	page_free(pa2page(PADDR(slab)));
+	cache->kc_nslabs--;
+}
+
+//
+// Allocate an object from 'cache'.
+// Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct KmemCache *cache)
+{
+	struct Slab *slab;
+	uint32_t i;
+
+	if ((slab = LIST_FIRST(&cache->kc_partial)) == NULL) {
+		if ((slab = cache->kc_empty) != NULL)
+			cache->kc_empty = NULL;
+		else if ((slab = kmem_slab_create(cache)) == NULL) {
+			cache->kc_fails++;
+			return NULL;
+		}
+		LIST_INSERT_HEAD(&cache->kc_partial, slab, sl_link);
+	}
+
+	i = slab->sl_free;
+	slab->sl_free = slab->sl_next[i];
+	if (++slab->sl_inuse == cache->kc_perslab) {
+		LIST_REMOVE(slab, sl_link);
+		LIST_INSERT_HEAD(&cache->kc_full, slab, sl_link);
+	}
+	cache->kc_inuse++;
+	cache->kc_allocs++;
+	return slab_obj(cache, slab, i);
+}
+
+//
+// Return 'obj' to 'cache'.  A cache keeps at most one empty slab
+// around; any others go back to the page allocator.
+//
+void
+kmem_cache_free(struct KmemCache *cache, void *obj)
+{
+	struct Slab *slab;
+	uint32_t i;
+
+	slab = ROUNDDOWN(obj, PGSIZE);
+	if (slab->sl_magic != SLAB_MAGIC || slab->sl_cache != cache)
+		panic("kmem_cache_free: %08x is not a %s object",
+		      obj, cache->kc_name);
+	i = ((char *) obj - (char *) slab - cache->kc_offset) / cache->kc_size;
+	assert(i < cache->kc_perslab && obj == slab_obj(cache, slab, i));
+
+	if (slab->sl_inuse == cache->kc_perslab) {
+		LIST_REMOVE(slab, sl_link);
+		LIST_INSERT_HEAD(&cache->kc_partial, slab, sl_link);
+	}
+	slab->sl_next[i] = slab->sl_free;
+	slab->sl_free = i;
+	cache->kc_inuse--;
+	cache->kc_frees++;
+
+	if (--slab->sl_inuse == 0) {
+		LIST_REMOVE(slab, sl_link);
+		if (cache->kc_empty == NULL)
+			cache->kc_empty = slab;
+		else
+			kmem_slab_destroy(cache, slab);
+	}
+}
+
+//
+// Allocate 'size' bytes of kernel memory.
+// Small requests come from the size-class caches; anything bigger than
+// KMEM_MAX_SMALL gets its own buddy block.  Returns NULL if out of memory.
+//
+void *
+malloc(size_t size)
+{
+	struct BigBlock *bb;
+	struct Page *pp;
+	int c, order;
+
+	if (size <= KMEM_MAX_SMALL) {
+		for (c = 0; (1 << (KMEM_MIN_SHIFT + c)) < size; c++)
+			/* do nothing */;
+		return kmem_cache_alloc(kmem_classes[c]);
+	}
+
+	for (order = 0; (PGSIZE << order) - sizeof(*bb) < size; order++)
+		if (order == PAGE_MAX_ORDER)
+			return NULL;
+	if (page_alloc_order(order, &pp) < 0)
+		return NULL;
+	bb = page2kva(pp);
+	bb->bb_magic = BIGBLOCK_MAGIC;
+	bb->bb_order = order;
+	bb->bb_size = size;
+	return bb + 1;
+}
+
+//
+// Free memory returned by malloc() (or by kmem_cache_alloc()).
+//
+void
+free(void *addr)
+{
+	struct Slab *slab;
+	struct BigBlock *bb;
+
+	if (addr == NULL)
+		return;
+
+	slab = ROUNDDOWN(addr, PGSIZE);
+	if (slab->sl_magic == SLAB_MAGIC) {
+		kmem_cache_free(slab->sl_cache, addr);
+		return;
+	}
+
+	bb = (struct BigBlock *) addr - 1;
+	if ((void *) bb != (void *) slab || bb->bb_magic != BIGBLOCK_MAGIC)
+		panic("free: bad pointer %08x", addr);
+	bb->bb_magic = 0;
+	page_free_order(pa2page(PADDR(bb)), bb->bb_order);
+}
+
+//
+// Print per-cache usage.  'overhead' is the memory held by the cache
+// that is not handed out as objects: header, padding and free objects.
+//
+void
+kmem_print_stats(void)
+{
+	struct KmemCache *cache;
+	uint32_t held;
+	int i;
+
+	cprintf("cache          objsize  inuse  total  slabs     allocs  overhead\n");
+	for (i = 0; i < kmem_ncaches; i++) {
+		cache = &kmem_caches[i];
+		held = cache->kc_nslabs * PGSIZE;
+		cprintf("%-14s %7u %6u %6u %6u %10u %8uB\n",
+			cache->kc_name, cache->kc_size, cache->kc_inuse,
+			cache->kc_nslabs * cache->kc_perslab,
+			cache->kc_nslabs, cache->kc_allocs,
+			held - cache->kc_inuse * cache->kc_size);
+		if (cache->kc_fails)
+			cprintf("               %u failed allocations\n",
+				cache->kc_fails);
+	}
+}
+
+//
+// Check the slab allocator and malloc.
+//
+static void
+check_kmem_ctor(void *obj)
+{
+	*(uint32_t *) obj = 0xC0FFEE;
+}
+
+static void
+check_kmem(void)
+{
+	static void *objs[300];
+	struct KmemCache *cache;
+	char *p, *q;
+	int i;
+
+	// size classes: allocations don't overlap and come back
+	for (i = 0; i < 300; i++) {
+		objs[i] = malloc(i * 7);
+		assert(objs[i]);
+		memset(objs[i], i, i * 7);
+	}
+	for (i = 0; i < 300; i++) {
+		p = objs[i];
+		assert(i == 0 || (p[0] == (char) i && p[i * 7 - 1] == (char) i));
+		free(p);
+	}
+	for (i = 0; i < KMEM_NCLASSES; i++)
+		assert(kmem_classes[i]->kc_inuse == 0
+		       && kmem_classes[i]->kc_nslabs <= 1);
+
+	// large blocks
+	p = malloc(3 * PGSIZE);
+	q = malloc(KMEM_MAX_SMALL + 1);
+	assert(p && q && p != q);
+	memset(p, 1, 3 * PGSIZE);
+	memset(q, 2, KMEM_MAX_SMALL + 1);
+	assert(p[3 * PGSIZE - 1] == 1);
+	free(p);
+	free(q);
+
+	// constructed objects survive free and reuse
+	cache = kmem_cache_create("check", 24, 0, check_kmem_ctor);
+	assert(cache && cache->kc_size == 24);
+	p = kmem_cache_alloc(cache);
+	assert(*(uint32_t *) p == 0xC0FFEE);
+	kmem_cache_free(cache, p);
+	q = kmem_cache_alloc(cache);
+	assert(q == p && *(uint32_t *) q == 0xC0FFEE);
+	kmem_cache_free(cache, q);
+	assert(cache->kc_inuse == 0 && cache->kc_allocs == 2);
+
+	// drop the check cache again
+	assert(cache == &kmem_caches[kmem_ncaches - 1]);
+	if (cache->kc_empty)
+		kmem_slab_destroy(cache, cache->kc_empty);
+	kmem_ncaches--;
+
+	cprintf("check_kmem() succeeded!\n");
+}
@@ -0,0 +1,54 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SLAB_H
+#define JOS_KERN_SLAB_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/queue.h>
+
+// Maximum number of object caches, including malloc's size classes
+#define KMEM_MAX_CACHES	32
+
+// malloc() serves requests up to this size from its size-class caches.
+// Larger requests get whole buddy blocks from page_alloc_order().
+#define KMEM_MAX_SMALL	1024
+
+struct Slab;
+LIST_HEAD(Slab_list, Slab);
+
+// A cache of equally sized objects, carved out of one-page slabs.
+// If the cache has a constructor, it runs once per object when the
+// object's slab is created, and freed objects are expected to be
+// returned in their constructed state; kmem_cache_alloc() and
+// kmem_cache_free() never call it.
+struct KmemCache {
+	const char *kc_name;
+	size_t kc_size;			// Object size, rounded up to kc_align
+	size_t kc_align;		// Object alignment
+	uint32_t kc_perslab;		// Objects per slab
+	size_t kc_offset;		// Offset of the first object in a slab
+	void (*kc_ctor)(void *obj);	// Constructor, or NULL
+
+	struct Slab_list kc_partial;	// Slabs with some free objects
+	struct Slab_list kc_full;	// Slabs with no free objects
+	struct Slab *kc_empty;		// One spare empty slab, or NULL
+
+	// Usage statistics
+	uint32_t kc_nslabs;		// Slabs currently held
+	uint32_t kc_inuse;		// Objects currently allocated
+	uint32_t kc_allocs;		// Total successful allocations
+	uint32_t kc_frees;		// Total frees
+	uint32_t kc_fails;		// Allocations that found no memory
+};
+
+void	kmem_init(void);
+struct KmemCache *kmem_cache_create(const char *name, size_t size,
+				    size_t align, void (*ctor)(void *));
+void	*kmem_cache_alloc(struct KmemCache *cache);
+void	kmem_cache_free(struct KmemCache *cache, void *obj);
+void	kmem_print_stats(void);
+
+#endif /* !JOS_KERN_SLAB_H */
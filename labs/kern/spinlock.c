@@ -0,0 +1,59 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/x86.h>
+#include <inc/assert.h>
+
+#include <kern/spinlock.h>
+#include <kern/cpu.h>
+
+void
+spin_initlock(struct Spinlock *lk, const char *name)
+{
+	lk->locked = 0;
+	lk->name = name;
+	lk->cpu = -1;
+}
+
+//
+// Does the current CPU hold the lock?
+//
+int
+spin_holding(struct Spinlock *lk)
+{
+	return lk->locked && lk->cpu == cpunum();
+}
+
+//
+// Acquire the lock, spinning until it is free.
+//
+void
+spin_lock(struct Spinlock *lk)
+{
+	if (spin_holding(lk))
+		panic("spin_lock: cpu %d already holds %s", cpunum(),
+		      lk->name ? lk->name : "lock");
+
+	// xchg is atomic and orders the loads and stores after it,
+	// so nothing in the critical section runs ahead of the lock.
+	// Spin on a plain read, so that waiting CPUs share the cache
+	// line instead of bouncing it between them.
+	while (xchg(&lk->locked, 1) != 0)
+		while (lk->locked)
+			asm volatile("pause");
+	lk->cpu = cpunum();
+}
+
+//
+// Release the lock.
+//
+void
+spin_unlock(struct Spinlock *lk)
+{
+	if (!spin_holding(lk))
+		panic("spin_unlock: cpu %d does not hold %s", cpunum(),
+		      lk->name ? lk->name : "lock");
+	lk->cpu = -1;
+	// The xchg keeps the stores of the critical section from
+	// moving past the release.
+	xchg(&lk->locked, 0);
+}
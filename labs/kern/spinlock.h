@@ -0,0 +1,27 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SPINLOCK_H
+#define JOS_KERN_SPINLOCK_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Mutual exclusion lock.  A CPU spins until the lock is free.
+// Spinlocks are not recursive: taking a lock the current CPU
+// already holds panics.
+struct Spinlock {
+	volatile uint32_t locked;	// Is the lock held?
+	const char *name;		// Name of lock, for debugging
+	int cpu;			// CPU holding the lock, or -1
+};
+
+#define SPINLOCK_INIT(lkname)	{ 0, (lkname), -1 }
+
+void	spin_initlock(struct Spinlock *lk, const char *name);
+void	spin_lock(struct Spinlock *lk);
+void	spin_unlock(struct Spinlock *lk);
+int	spin_holding(struct Spinlock *lk);
+
+#endif	// !JOS_KERN_SPINLOCK_H
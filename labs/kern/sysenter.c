@@ -0,0 +1,58 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/error.h>
+#include <inc/memlayout.h>
+
+#include <kern/trap.h>
+
+// Entry point in kern/sysentry.S
+void sysenter_handler(void);
+
+//
+// Point SYSENTER at sysenter_handler, on the kernel stack, if the CPU
+// has it.  Otherwise user code has to stick to int T_SYSCALL.
+// i386_init() calls this once i386_vm_init() has loaded the GDT:
+// SYSENTER and
+// SYSEXIT derive the kernel's %ss and the user's %cs and %ss from
+// GD_KT, which only works because GD_KD, GD_UT and GD_UD follow it in
+// that order.
+//
+void
+sysenter_init(void)
+{
+	uint32_t eax, edx;
+
+	cpuid(1, &eax, NULL, NULL, &edx);
+	if (!(edx & CPUID_SEP))
+		return;
+	// The first Pentium Pros set CPUID_SEP without having SYSENTER.
+	if (((eax >> 8) & 0xF) == 6 && ((eax >> 4) & 0xF) < 3
+	    && (eax & 0xF) < 3)
+		return;
+
+	wrmsr(MSR_IA32_SYSENTER_CS, GD_KT);
+	wrmsr(MSR_IA32_SYSENTER_ESP, KSTACKTOP);
+	wrmsr(MSR_IA32_SYSENTER_EIP, (uint32_t) sysenter_handler);
+}
+
+//
+// Called by sysenter_handler with system call 'num' and its arguments.
+//
+// This is a stub: the tree has no system call layer (kern/syscall.c)
+// yet, so every call fails.  Once syscall() exists, this should pass on the calls
+// that return straight to their caller (sys_cputs, sys_cgetc,
+// sys_getenvid, sys_mem_alloc, sys_mem_map, sys_mem_unmap) and keep
+// failing the ones that save or switch curenv->env_tf (sys_yield,
+// sys_exofork, sys_ipc_recv, ...), which this path never fills in.
+//
+// RETURNS:
+//   -E_INVAL, for now always
+//
+int32_t
+sysenter_syscall(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3,
+		 uint32_t a4)
+{
+	return -E_INVAL;
+}
@@ -17,5 +17,6 @@ void print_regs(struct PushRegs *regs);
 void print_trapframe(struct Trapframe *tf);
 void page_fault_handler(struct Trapframe *);
 void backtrace(struct Trapframe *);
+void sysenter_init(void);
 
 #endif /* JOS_KERN_TRAP_H */
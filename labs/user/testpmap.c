@@ -62,7 +62,7 @@ alloc_range(int initaddr, int maxpa, int startn) {
   // - limit to 256 M worth of pages
   for (va = initva; va < maxva; va += PGSIZE, n++) { 
     // alloc a page 
-    if ((r = sys_mem_alloc(0, va, PTE_P | PTE_U | PTE_W | PTE_AVAIL)) < 0) { 
+    if ((r = sys_mem_alloc(0, va, PTE_P | PTE_U | PTE_W | PTE_USER_AVAIL)) < 0) { 
       //cprintf("\nsys_mem_alloc failed: %e", r);
       break;
     }
@@ -82,6 +82,34 @@ alloc_range(int initaddr, int maxpa, int startn) {
   return n;
 }
 
+// Like alloc_range, but with 4MB pages (PTE_PS): one system call,
+// one page directory entry and one TLB entry per PDMAP.
+int
+alloc_range_large(int initaddr, int maxpa, int startn) {
+  int xva;
+
+  n = startn;
+  maxnum = maxpa / PGSIZE;
+  initva = initaddr;
+  maxva = initva + maxpa;
+
+  cprintf ("[%08x] trying to alloc 4MB pages in range [%08x, %08x]\n", env->env_id, initva, maxva);
+
+  for (va = initva; va < maxva; va += PDMAP) {
+    if ((r = sys_mem_alloc(0, va, PTE_P | PTE_U | PTE_W | PTE_USER_AVAIL | PTE_PS)) < 0)
+      break;
+    for (xva = va; xva < va + PDMAP; xva += PGSIZE, n++)
+      mark_page((int*)xva, n);
+    cprintf(".");
+  }
+  cprintf("\n");
+
+  cprintf("[%08x] able to allocate [%d] pages of requested [%d] pages\n", env->env_id, n, maxnum);
+
+  maxva = va;
+  return n;
+}
+
 int
 test_range(int startva, int endva, int startn) {
   int c;
@@ -101,7 +129,9 @@ test_range(int startva, int endva, int startn) {
       failures++;
     } else {
       Pte pte = vpt[VPN(va)];
-      int perm = (PTE_U | PTE_P | PTE_W | PTE_AVAIL);
+      if (vpd[PDX(va)] & PTE_PS)
+        pte = vpd[PDX(va)];
+      int perm = (PTE_U | PTE_P | PTE_W | PTE_USER_AVAIL);
 
       if ((pte & perm) != perm) {
 	cprintf("\n[%08x] unexpected PTE permissions [04x] for address [%08x]\n {", env->env_id, pte & perm, va);
@@ -206,6 +236,11 @@ umain(int argc, char **argv)
     //unmap_range(UTEXT+PDMAP, max);
   }
 
+  // Same again with 4MB pages, which need no page tables at all.
+  cprintf("PMAPTEST[%08x] starting 4MB page ROUND.\n", env->env_id);
+  alloc_range_large(UTEXT+PDMAP, (256 * 1024 * 1024), 0);
+  test_range(UTEXT+PDMAP, maxva, 0);
+  unmap_range(UTEXT+PDMAP, maxva);
 }
 
 //#endif
@@ -0,0 +1,114 @@
+//#ifdef LAB >= 4
+
+// Multi-CPU variant of testpmap: each copy of this program hammers
+// sys_mem_alloc/sys_mem_unmap in its own address space and reports
+// how many cycles each page operation took.  Boot with one copy per
+// CPU (e.g., qemu -smp 1, 2, 4 with as many copies created) and compare
+// the per-page cost: with per-address-space pmap locks it should stay
+// about flat as CPUs are added, since the copies only meet on the page
+// allocator's page_lock.
+//
+// Nothing builds this yet: the tree has neither the user library nor
+// the system calls it uses.  The kernel does not start the other CPUs
+// either, nor shoot down their TLBs (see the locking comment in
+// kern/pmap.c), so even then the copies would all run on the bootstrap
+// processor, and this would measure one CPU only.  There is no scaling
+// result until both arrive.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUNDS		8
+#define NPAGES		1024			// one page table's worth
+
+int sequence_length = 16;
+int sequence[] = { 0,  1,   1,   2,   3,
+		   5,  8,  13,  21,  34,
+		  55, 89, 144, 233, 377, 610};
+
+void
+mark_page(int* pg, int i) {
+  int j;
+  for (j = 0; j < sequence_length; j++)
+    pg[j] = i + sequence[j];
+}
+
+int
+test_page(int* pg, int i) {
+  int j;
+  for (j = 0; j < sequence_length; j++)
+    if (pg[j] != i + sequence[j])
+      return 1;
+
+  return 0;
+}
+
+// Map NPAGES fresh pages at va and mark each one.
+// Returns the number of pages mapped.
+int
+alloc_range(int va, int startn) {
+  int n, r;
+
+  for (n = 0; n < NPAGES; n++) {
+    if ((r = sys_mem_alloc(0, va + n * PGSIZE, PTE_P | PTE_U | PTE_W)) < 0) {
+      cprintf("[%08x] sys_mem_alloc failed: %e\n", env->env_id, r);
+      break;
+    }
+    mark_page((int*)(va + n * PGSIZE), startn + n);
+  }
+  return n;
+}
+
+// Check that the pages are still ours, i.e. that no other CPU was
+// handed one of them while we had it mapped.
+int
+test_range(int va, int n, int startn) {
+  int i, failures = 0;
+
+  for (i = 0; i < n; i++)
+    if (test_page((int*)(va + i * PGSIZE), startn + i)) {
+      cprintf("[%08x] unexpected value at [%08x]\n", env->env_id, va + i * PGSIZE);
+      failures++;
+    }
+  return failures;
+}
+
+void
+unmap_range(int va, int n) {
+  int i;
+
+  for (i = 0; i < n; i++)
+    sys_mem_unmap(0, va + i * PGSIZE);
+}
+
+void
+umain(int argc, char **argv)
+{
+  uint64_t start, cycles;
+  uint32_t ops;
+  int i, n, va, failures;
+
+  // Every copy uses the same addresses; they live in different
+  // address spaces, so only the page allocator is shared.
+  va = UTEXT + PDMAP;
+  cycles = 0;
+  ops = 0;
+  failures = 0;
+  for (i = 0; i < NROUNDS; i++) {
+    start = read_tsc();
+    n = alloc_range(va, i * NPAGES);
+    failures += test_range(va, n, i * NPAGES);
+    unmap_range(va, n);
+    cycles += read_tsc() - start;
+    ops += 2 * n;
+
+    // Let copies on the same CPU interleave with us.
+    sys_yield();
+  }
+
+  cprintf("PMAPTEST-MP[%08x] %d rounds, %u page ops, %u cycles/op, "
+	  "%d failed assertions.\n", env->env_id, NROUNDS, ops,
+	  ops ? (uint32_t) (cycles / ops) : 0, failures);
+}
+
+//#endif
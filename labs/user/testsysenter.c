@@ -0,0 +1,66 @@
+//#ifdef LAB >= 3
+
+// System call latency: time the same cheap system call through int
+// T_SYSCALL and through SYSENTER, and report cycles per call for each.
+// This program needs the user library and kern/syscall.c, which this
+// tree doesn't have yet, so nothing builds it.  Until they arrive,
+// sysenter_syscall() is a stub that fails every call.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCALLS_SHIFT	16
+#define NCALLS		(1 << NCALLS_SHIFT)
+
+// A system call through SYSENTER, with the register convention from
+// inc/trap.h: %esi and %ebp tell the kernel where to come back to.
+static inline int32_t
+sysenter_call(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4)
+{
+  asm volatile("pushl %%ebp\n\t"
+	       "movl %%esp, %%ebp\n\t"
+	       "leal 1f, %%esi\n\t"
+	       "sysenter\n"
+	       "1:\tpopl %%ebp"
+	       : "+a" (num), "+d" (a1), "+c" (a2)
+	       : "b" (a3), "D" (a4)
+	       : "esi", "memory", "cc");
+  return num;
+}
+
+void
+umain(int argc, char **argv)
+{
+  uint64_t start, int_cycles, sysenter_cycles;
+  uint32_t edx;
+  envid_t id;
+  int i;
+
+  cpuid(1, NULL, NULL, NULL, &edx);
+  if (!(edx & CPUID_SEP)) {
+    cprintf("SYSCALLTEST[%08x] no SYSENTER on this CPU.\n", env->env_id);
+    return;
+  }
+
+  id = sys_getenvid();
+  if (sysenter_call(SYS_getenvid, 0, 0, 0, 0) != id) {
+    cprintf("SYSCALLTEST[%08x] sysenter returned the wrong env id.\n", env->env_id);
+    return;
+  }
+
+  start = read_tsc();
+  for (i = 0; i < NCALLS; i++)
+    sys_getenvid();
+  int_cycles = read_tsc() - start;
+
+  start = read_tsc();
+  for (i = 0; i < NCALLS; i++)
+    sysenter_call(SYS_getenvid, 0, 0, 0, 0);
+  sysenter_cycles = read_tsc() - start;
+
+  cprintf("SYSCALLTEST[%08x] %d calls: int %u cycles/call, sysenter %u cycles/call.\n",
+	  env->env_id, NCALLS, (uint32_t) (int_cycles >> NCALLS_SHIFT),
+	  (uint32_t) (sysenter_cycles >> NCALLS_SHIFT));
+}
+
+//#endif